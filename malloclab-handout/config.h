@@ -19,7 +19,9 @@
  * will use for testing. Modify this if you want to add or delete
  * traces from the driver's test suite. For example, if you don't want
  * your students to implement realloc, you can delete the last two
- * traces.
+ * traces. Traces of weight 0 (the last number of their header), like
+ * calloc-bal.rep and memalign-bal.rep, are checked for correctness but
+ * leave the score alone.
  */
 #define DEFAULT_TRACEFILES \
   "amptjp-bal.rep",\
@@ -30,7 +32,10 @@
   "random-bal.rep",\
   "random2-bal.rep",\
   "binary-bal.rep",\
-  "binary2-bal.rep"
+  "binary2-bal.rep",\
+  "calloc-bal.rep",\
+  "memalign-bal.rep",\
+  "trim-bal.rep"
 
 /*
  * This constant gives the estimated performance of the libc malloc
@@ -55,6 +60,12 @@
  */
 #define ALIGNMENT 8  
 
+/*
+ * Number of blocks mm_checkheap_step checks after every request while
+ * the driver checks a trace for correctness
+ */
+#define CHECK_STEP 16
+
 /* 
  * Maximum heap size in bytes 
  */
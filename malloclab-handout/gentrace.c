@@ -0,0 +1,473 @@
+/*
+ * gentrace.c - Generate synthetic traces from size and lifetime models
+ *
+ * Sizes are drawn from a truncated power law, a bimodal mix or an
+ * empirical histogram; blocks are freed FIFO, LIFO, at random or in
+ * phases, and live blocks may be grown by realloc. Freed ids are reused,
+ * so num_ids stays near the number of live blocks however many requests
+ * are generated, and the output, .rep or binary (trace.h) by the file
+ * name, is written as it is generated. Very long traces are meant for
+ * "mdriver -s".
+ */
+#include "trace.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAXLINE 1024
+#define BATCH 4096        /* binary records written per fwrite */
+#define PHASE_SURVIVE 8   /* one in this many blocks of a phase outlives it */
+
+/* Size models */
+enum { SIZE_POW,
+       SIZE_BI,
+       SIZE_EMP };
+
+/* Lifetime models */
+enum { LIFE_FIFO,
+       LIFE_LIFO,
+       LIFE_RANDOM,
+       LIFE_PHASE };
+
+/* Realloc growth models */
+enum { GROW_DOUBLE,
+       GROW_LINEAR,
+       GROW_RANDOM };
+
+/* A set of live ids: a ring for FIFO and LIFO, any element for random */
+typedef struct {
+    uint32_t *ids;
+    uint64_t head, count, mask;
+} pool_t;
+
+static uint64_t rng_state;
+
+/* The model, from the command line */
+static int size_model = SIZE_POW, life_model = LIFE_RANDOM, grow_model = GROW_DOUBLE;
+static double pow_alpha = 1.5, bi_p = 0.9;
+static uint32_t size_min = 16, size_max = 4096, bi_small = 32, bi_large = 16384;
+static uint32_t grow_step = 64, grow_max = 1u << 20;
+static uint32_t *emp_size;
+static double *emp_cdf;
+static int emp_n;
+
+/* Output state */
+static FILE *out;
+static int binary;
+static traceop_t batch[BATCH];
+static int nbatch;
+static uint64_t num_ops;
+
+/* Per id sizes and the ids free for reuse */
+static uint32_t *id_size;
+static uint32_t *free_ids;
+static uint32_t num_free, num_ids, max_ids;
+static uint64_t live_bytes, peak_bytes;
+
+static void usage(void) {
+    fprintf(stderr, "Usage: gentrace [-h] [-n <ops>] [-l <live>] [-s <sizes>] [-L <life>]\n"
+                    "                [-r <pct>] [-g <growth>] [-S <seed>] <out.rep|out.bin>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-n <ops>    Requests before the final frees (default 1000000).\n");
+    fprintf(stderr, "\t-l <live>   Live blocks in the steady state, or per phase (default 10000).\n");
+    fprintf(stderr, "\t-s pow:<min>:<max>:<alpha>  Power law sizes (default pow:16:4096:1.5).\n");
+    fprintf(stderr, "\t-s bi:<small>:<large>:<p>   Small with probability p, else large.\n");
+    fprintf(stderr, "\t-s emp:<file>               Sizes from \"size [weight]\" lines.\n");
+    fprintf(stderr, "\t-L fifo|lifo|random|phase   Which block is freed (default random).\n");
+    fprintf(stderr, "\t-r <pct>    Percent of requests that realloc a live block (default 0).\n");
+    fprintf(stderr, "\t-g double|lin:<bytes>|rand  How realloc resizes (default double).\n");
+    fprintf(stderr, "\t-S <seed>   Random seed (default 1).\n");
+    exit(1);
+}
+
+static void die(char *msg, char *arg) {
+    fprintf(stderr, "gentrace: %s %s\n", msg, arg);
+    exit(1);
+}
+
+/* rng - splitmix64 */
+static uint64_t rng(void) {
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+/* rng_unit - uniform in [0, 1) */
+static double rng_unit(void) {
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* rng_below - uniform in [0, n) */
+static uint64_t rng_below(uint64_t n) {
+    return (uint64_t)(rng_unit() * n);
+}
+
+/*
+ * load_empirical - Read "size [weight]" lines into the cumulative
+ *    distribution emp_cdf; '#' starts a comment.
+ */
+static void load_empirical(char *path) {
+    FILE *f;
+    char line[MAXLINE];
+    unsigned long size;
+    double weight, total = 0;
+    int cap = 0;
+
+    if ((f = fopen(path, "r")) == NULL)
+        die("could not open", path);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        weight = 1;
+        if (line[0] == '#' || sscanf(line, "%lu %lf", &size, &weight) < 1)
+            continue;
+        if (size == 0 || size > UINT32_MAX || weight < 0)
+            die("bad size or weight in", path);
+        if (emp_n == cap) {
+            cap = cap ? 2 * cap : 64;
+            if ((emp_size = realloc(emp_size, cap * sizeof(*emp_size))) == NULL ||
+                (emp_cdf = realloc(emp_cdf, cap * sizeof(*emp_cdf))) == NULL)
+                die("out of memory reading", path);
+        }
+        total += weight;
+        emp_size[emp_n] = size;
+        emp_cdf[emp_n++] = total;
+    }
+    fclose(f);
+    if (total <= 0)
+        die("no sizes in", path);
+    for (int i = 0; i < emp_n; i++)
+        emp_cdf[i] /= total;
+}
+
+/* sample_size - Draw a request size from the size model */
+static uint32_t sample_size(void) {
+    double u = rng_unit();
+
+    switch (size_model) {
+    case SIZE_POW: {
+        /* inverse of the Pareto CDF, truncated to [size_min, size_max] */
+        double tail = pow((double)size_min / size_max, pow_alpha);
+        double x = size_min * pow(1 - u * (1 - tail), -1 / pow_alpha);
+        return (x < size_max) ? (uint32_t)x : size_max;
+    }
+    case SIZE_BI:
+        return (u < bi_p) ? bi_small : bi_large;
+    default: {
+        int lo = 0, hi = emp_n - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (emp_cdf[mid] <= u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return emp_size[lo];
+    }
+    }
+}
+
+/* grow_size - The size a realloc of a block of size bytes asks for */
+static uint32_t grow_size(uint32_t size) {
+    uint64_t next;
+
+    switch (grow_model) {
+    case GROW_DOUBLE:
+        next = 2 * (uint64_t)size;
+        break;
+    case GROW_LINEAR:
+        next = (uint64_t)size + grow_step;
+        break;
+    default:
+        return sample_size();
+    }
+    /* a block grown as far as it goes starts over */
+    return (next <= grow_max) ? next : sample_size();
+}
+
+/* emit - Write one request to the output */
+static void emit(int type, uint32_t index, uint32_t size) {
+    num_ops++;
+    if (!binary) {
+        if (type == FREE)
+            fprintf(out, "f %u\n", index);
+        else
+            fprintf(out, "%c %u %u\n", (type == ALLOC) ? 'a' : 'r', index, size);
+        return;
+    }
+    batch[nbatch].type = type;
+    batch[nbatch].index = index;
+    batch[nbatch].size = size;
+    if (++nbatch == BATCH) {
+        fwrite(batch, sizeof(traceop_t), nbatch, out);
+        nbatch = 0;
+    }
+}
+
+static void pool_init(pool_t *pool, uint64_t cap) {
+    uint64_t n = 1;
+
+    while (n < cap)
+        n <<= 1;
+    if ((pool->ids = malloc(n * sizeof(uint32_t))) == NULL)
+        die("out of memory for", "the live blocks");
+    pool->head = pool->count = 0;
+    pool->mask = n - 1;
+}
+
+static void pool_push(pool_t *pool, uint32_t id) {
+    pool->ids[(pool->head + pool->count++) & pool->mask] = id;
+}
+
+/* pool_pick - A live id without removing it */
+static uint32_t pool_pick(pool_t *pool) {
+    return pool->ids[(pool->head + rng_below(pool->count)) & pool->mask];
+}
+
+/* pool_take - Remove an id: the oldest, the newest or any as model says */
+static uint32_t pool_take(pool_t *pool, int model) {
+    uint32_t *last = &pool->ids[(pool->head + pool->count - 1) & pool->mask];
+    uint32_t id;
+
+    if (model == LIFE_FIFO) {
+        id = pool->ids[pool->head++ & pool->mask];
+    } else if (model == LIFE_LIFO) {
+        id = *last;
+    } else {
+        /* the last one fills the hole */
+        uint32_t *slot = &pool->ids[(pool->head + rng_below(pool->count)) & pool->mask];
+        id = *slot;
+        *slot = *last;
+    }
+    pool->count--;
+    return id;
+}
+
+/* do_alloc - Allocate a block under a free id and add it to pool */
+static void do_alloc(pool_t *pool) {
+    uint32_t id, size = sample_size();
+
+    if (num_free > 0) {
+        id = free_ids[--num_free];
+    } else {
+        if (num_ids == max_ids)
+            die("more live blocks than", "the id table holds");
+        id = num_ids++;
+    }
+    id_size[id] = size;
+    live_bytes += size;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+    emit(ALLOC, id, size);
+    pool_push(pool, id);
+}
+
+/* do_free - Free the id taken from a pool and make it reusable */
+static void do_free(uint32_t id) {
+    live_bytes -= id_size[id];
+    emit(FREE, id, 0);
+    free_ids[num_free++] = id;
+}
+
+/* do_realloc - Resize a live block of pool, which keeps its id */
+static void do_realloc(pool_t *pool) {
+    uint32_t id = pool_pick(pool), size = grow_size(id_size[id]);
+
+    live_bytes += (int64_t)size - id_size[id];
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+    id_size[id] = size;
+    emit(REALLOC, id, size);
+}
+
+/*
+ * generate - Emit ops requests, then free every block still live. The
+ *    number of live blocks drifts towards live: a request allocates with
+ *    probability 1 - count / (2 live), so that freeing and allocating are
+ *    even at live. In phases, live blocks are allocated and then freed in
+ *    random order but for one in PHASE_SURVIVE, which joins at most live
+ *    long lived blocks freed at random.
+ */
+static void generate(uint64_t ops, uint64_t live, double realloc_pct) {
+    pool_t pool, old;
+    uint64_t i = 0, phase_left = live;
+    int phase = (life_model == LIFE_PHASE);
+
+    pool_init(&pool, 2 * live + 1);
+    pool_init(&old, live + 1);
+    while (i < ops) {
+        if (pool.count > 0 && rng_unit() * 100 < realloc_pct) {
+            do_realloc(&pool);
+            i++;
+        } else if (!phase) {
+            if (pool.count == 0 || (pool.count < 2 * live && rng_unit() * 2 * live >= pool.count))
+                do_alloc(&pool);
+            else
+                do_free(pool_take(&pool, life_model));
+            i++;
+        } else if (phase_left > 0) {
+            do_alloc(&pool);
+            phase_left--;
+            i++;
+        } else {
+            /* the phase is over */
+            while (pool.count > 0 && i < ops) {
+                uint32_t id = pool_take(&pool, LIFE_RANDOM);
+                if (rng_below(PHASE_SURVIVE) == 0) {
+                    if (old.count == live) {
+                        do_free(pool_take(&old, LIFE_RANDOM));
+                        i++;
+                    }
+                    pool_push(&old, id);
+                } else {
+                    do_free(id);
+                    i++;
+                }
+            }
+            phase_left = live;
+        }
+    }
+    while (pool.count > 0)
+        do_free(pool_take(&pool, LIFE_FIFO));
+    while (old.count > 0)
+        do_free(pool_take(&old, LIFE_FIFO));
+    free(pool.ids);
+    free(old.ids);
+}
+
+/* parse_sizes - Set the size model from a -s argument */
+static void parse_sizes(char *arg) {
+    unsigned long a, b;
+    double x;
+
+    if (!strncmp(arg, "emp:", 4)) {
+        size_model = SIZE_EMP;
+        load_empirical(arg + 4);
+    } else if (sscanf(arg, "pow:%lu:%lu:%lf", &a, &b, &x) == 3 &&
+               a > 0 && a <= b && b <= UINT32_MAX && x > 0) {
+        size_model = SIZE_POW;
+        size_min = a;
+        size_max = b;
+        pow_alpha = x;
+    } else if (sscanf(arg, "bi:%lu:%lu:%lf", &a, &b, &x) == 3 &&
+               a > 0 && b > 0 && a <= UINT32_MAX && b <= UINT32_MAX && x >= 0 && x <= 1) {
+        size_model = SIZE_BI;
+        bi_small = a;
+        bi_large = b;
+        bi_p = x;
+    } else {
+        usage();
+    }
+}
+
+int main(int argc, char **argv) {
+    uint64_t ops = 1000000, live = 10000;
+    double realloc_pct = 0;
+    size_t len;
+    int c;
+
+    rng_state = 1;
+    while ((c = getopt(argc, argv, "hn:l:s:L:r:g:S:")) != EOF) {
+        switch (c) {
+        case 'n':
+            ops = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            live = strtoull(optarg, NULL, 10);
+            if (live == 0 || live > TRACE_MAX_INDEX / 2)
+                usage();
+            break;
+        case 's':
+            parse_sizes(optarg);
+            break;
+        case 'L':
+            if (!strcmp(optarg, "fifo"))
+                life_model = LIFE_FIFO;
+            else if (!strcmp(optarg, "lifo"))
+                life_model = LIFE_LIFO;
+            else if (!strcmp(optarg, "random"))
+                life_model = LIFE_RANDOM;
+            else if (!strcmp(optarg, "phase"))
+                life_model = LIFE_PHASE;
+            else
+                usage();
+            break;
+        case 'r':
+            realloc_pct = atof(optarg);
+            if (realloc_pct < 0 || realloc_pct >= 100)
+                usage();
+            break;
+        case 'g':
+            if (!strcmp(optarg, "double"))
+                grow_model = GROW_DOUBLE;
+            else if (!strcmp(optarg, "rand"))
+                grow_model = GROW_RANDOM;
+            else if (sscanf(optarg, "lin:%u", &grow_step) == 1 && grow_step > 0)
+                grow_model = GROW_LINEAR;
+            else
+                usage();
+            break;
+        case 'S':
+            rng_state = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1)
+        usage();
+    len = strlen(argv[optind]);
+    binary = len >= 4 && !strcmp(argv[optind] + len - 4, ".bin");
+    if (!binary && ops + 2 * live > INT32_MAX)
+        die("a .rep header can't count that many requests, write a .bin instead of", argv[optind]);
+    /* grown blocks stay under the largest size drawn, and at least 1 MB */
+    if (size_model == SIZE_POW && size_max > grow_max)
+        grow_max = size_max;
+    if (size_model == SIZE_BI && (bi_small > grow_max || bi_large > grow_max))
+        grow_max = (bi_small > bi_large) ? bi_small : bi_large;
+    for (int i = 0; i < emp_n; i++)
+        if (emp_size[i] > grow_max)
+            grow_max = emp_size[i];
+
+    /* at most 2 live blocks in the pool, live in phases plus live old ones */
+    max_ids = 2 * live + 1;
+    if ((id_size = malloc(max_ids * sizeof(uint32_t))) == NULL ||
+        (free_ids = malloc(max_ids * sizeof(uint32_t))) == NULL)
+        die("out of memory for", "the id table");
+    if ((out = fopen(argv[optind], "w")) == NULL)
+        die("could not create", argv[optind]);
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+
+    /* the header goes out again once the counts are known; the .rep one
+       is padded so the rewrite fits */
+    bintrace_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BINTRACE_MAGIC, sizeof(hdr.magic));
+    hdr.weight = 1;
+    if (binary)
+        fwrite(&hdr, sizeof(hdr), 1, out);
+    else
+        fprintf(out, "%10d %10d %10d %d\n", 0, 0, 0, 1);
+
+    generate(ops, live, realloc_pct);
+
+    if (binary) {
+        fwrite(batch, sizeof(traceop_t), nbatch, out);
+        hdr.sugg_heapsize = (peak_bytes < UINT32_MAX) ? peak_bytes : UINT32_MAX;
+        hdr.num_ids = num_ids;
+        hdr.num_ops = num_ops;
+    }
+    if (fseek(out, 0, SEEK_SET) != 0)
+        die("could not write", argv[optind]);
+    if (binary)
+        fwrite(&hdr, sizeof(hdr), 1, out);
+    else
+        fprintf(out, "%10lu %10u %10lu %d", (unsigned long)(peak_bytes < INT32_MAX ? peak_bytes : INT32_MAX),
+                num_ids, (unsigned long)num_ops, 1);
+    if (ferror(out) || fclose(out) != 0)
+        die("could not write", argv[optind]);
+    printf("%s: %lu requests, %u ids, peak payload %luk\n", argv[optind],
+           (unsigned long)num_ops, num_ids, (unsigned long)(peak_bytes / 1024));
+    return 0;
+}
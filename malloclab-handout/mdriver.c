@@ -7,18 +7,35 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* sched_setaffinity */
+#include "clock.h"
 #include "config.h"
 #include "fsecs.h"
 #include "memlib.h"
 #include "mm.h"
+#include "trace.h"
 #include <assert.h>
 #include <ctype.h>
+#include <dlfcn.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
 #include <getopt.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <malloc.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -37,26 +54,52 @@
 //Heap size is allowed to be 65536 for free, since this is paltry
 #define FREE_HEAP 65536
 
+#define MAX_THREADS 64 /* most threads -T can ask for */
+#define STREAM_CHUNK (1 << 20) /* requests replayed at once by -s */
+#define MAX_ALLOCATORS 16 /* most allocators -A can compare */
+#define BENCH_TRIALS 5    /* timed runs of each trace per allocator with -A */
+#define BENCH_WARMUP 1    /* untimed runs before them */
+
+/*
+ * Latency histograms (-H) are log bucketed like HdrHistogram: values
+ * below HIST_SUB get a bucket each, above that every power of two is
+ * split into HIST_SUB buckets, so a bucket is at most 1/HIST_SUB wide
+ * relative to its values.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Hardware events -C counts with perf_event_open, in user space only */
+#define CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+#define NUM_COUNTERS 6
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} counter_events[NUM_COUNTERS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instrs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1d miss", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {"LLC miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"dTLB miss", PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {"faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
 /******************************
  * The key compound data types
  *****************************/
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, a node of the range tree */
 typedef struct range_t {
-    char *lo;             /* low payload address */
-    char *hi;             /* high payload address */
-    struct range_t *next; /* next list element */
+    char *lo;              /* low payload address */
+    char *hi;              /* high payload address */
+    struct range_t *left;  /* ranges below lo */
+    struct range_t *right; /* ranges above hi */
+    unsigned prio;         /* treap priority, above those of the children */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum { ALLOC,
-           FREE,
-           REALLOC } type; /* type of request */
-    int index;             /* index for free() to use later */
-    int size;              /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
@@ -66,6 +109,8 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    void *map;           /* mapping of a binary trace file that ops points into */
+    size_t map_size;
 } trace_t;
 
 /*
@@ -95,6 +140,58 @@ typedef struct {
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
 
+/* Latencies in cycles of one kind of request */
+typedef struct {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t n;   /* requests recorded */
+    uint64_t max; /* exact largest latency */
+} hist_t;
+
+/*
+ * Holds the params and results of one thread of a multi-threaded
+ * replay (-T). Each thread replays the whole trace, or with -p only the
+ * requests whose ids belong to its partition (index % nthreads == tid),
+ * into blocks of its own.
+ */
+typedef struct {
+    trace_t *trace;
+    int use_libc;             /* replay against libc malloc instead of mm */
+    int partition;            /* replay only this thread's ids */
+    int tid, nthreads;
+    char **blocks;            /* this thread's copy of trace->blocks */
+    uint32_t *lat;            /* latency of each replayed request in ns */
+    int nops;                 /* requests replayed */
+    double secs;              /* time this thread took */
+    pthread_barrier_t *start; /* releases all threads at once */
+} replay_t;
+
+/*
+ * An allocator the benchmark harness (-A) replays traces against: mm
+ * itself, mm under one placement policy, libc, or an mm.so built with
+ * other MMFLAGS and loaded with dlopen.
+ */
+typedef struct {
+    char name[MAXLINE];
+    int policy;                   /* placement policy to run mm with, -1 to keep it */
+    int (*set_policy)(int policy);
+    void (*reset)(void);          /* mem_reset_brk, NULL for libc */
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void *(*calloc)(size_t n, size_t size);
+    void *(*memalign)(size_t align, size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    size_t (*peak)(void);         /* peak heap bytes since reset, NULL if unknown */
+} allocator_t;
+
+/* What the harness measured for one allocator on one trace */
+typedef struct {
+    double util;      /* -1 where the allocator can't tell its heap size */
+    double kops_mean; /* over the timed trials */
+    double kops_ci;   /* half width of the 95% confidence interval */
+    double kops_min, kops_max;
+} bench_t;
+
 /********************
  * Global variables
  *******************/
@@ -114,7 +211,7 @@ static char *default_tracefiles[] = {
  * Function prototypes
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size,
                      int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
@@ -122,8 +219,12 @@ static void clear_ranges(range_t **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static trace_t *map_bintrace(trace_t *trace, char *path);
 static void free_trace(trace_t *trace);
 
+/* Replays a trace chunk by chunk without holding it in memory */
+static void stream_trace(char *tracedir, char *filename);
+
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
@@ -134,6 +235,29 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, int *ideal_m, int *m);
 static void eval_mm_speed(void *ptr);
 
+/* Routines for measuring how either package scales over threads */
+static void *eval_replay_thread(void *ptr);
+static void eval_scaling(char *filename, trace_t *trace, int max_threads, int partition, int use_libc);
+
+/* Replays a trace up to its peak and prints the package's statistics */
+static void eval_mm_stats(trace_t *trace);
+
+/* Routines for per request latency histograms */
+static void hist_record(hist_t *h, uint64_t value);
+static uint64_t hist_percentile(hist_t *h, double p);
+static void eval_mm_latency(trace_t *trace, hist_t hist[3], double overhead);
+static double timer_overhead(void);
+
+/* Routines for counting hardware events per request */
+static int counters_open(int fd[NUM_COUNTERS]);
+static void eval_mm_counters(trace_t *trace, int fd[NUM_COUNTERS], double per_op[NUM_COUNTERS]);
+
+/* Routines for the benchmark harness */
+static void allocator_get(allocator_t *alloc, const char *spec);
+static void bench_trace(allocator_t *alloc, trace_t *trace, int trials, int warmup, bench_t *b);
+static void bench_all(allocator_t *allocs, int num_allocs, char **tracefiles, int num_tracefiles,
+                      int trials, int warmup, int cpu, const char *outfile);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
 static void usage(void);
@@ -160,6 +284,21 @@ int main(int argc, char **argv) {
     int team_check = 1; /* If set, check team structure (reset by -a) */
     int run_libc = 0;   /* If set, run libc malloc (set by -l) */
     int autograder = 0; /* If set, emit summary info for autograder (-g) */
+    int max_threads = 0; /* If set, replay on 1..max_threads threads (-T) */
+    int partition = 0;   /* If set, threads split the trace's ids (-p) */
+    int run_hist = 0;    /* If set, print latency percentiles per request type (-H) */
+    int run_stats = 0;   /* If set, print mm_stats at each trace's peak (-S) */
+    int run_counters = 0; /* If set, print hardware event counts per request (-C) */
+    int stream = 0;      /* If set, only stream the -f trace through mm (-s) */
+    int policies[3];     /* placement policies to evaluate mm with (-P) */
+    int num_policies = 0;
+    static const char *policyname[3] = {"first", "best", "good"};
+    allocator_t *allocs = NULL; /* allocators the harness compares (-A) */
+    int num_allocs = 0;
+    int trials = BENCH_TRIALS; /* timed runs per trace and allocator (-n) */
+    int warmup = BENCH_WARMUP; /* untimed runs before them (-w) */
+    int cpu = -1;              /* CPU to pin the harness to (-c) */
+    char *outfile = NULL;      /* where the harness writes its results (-o) */
 
     /* temporaries used to compute the performance index */
     double util, scaled_util, throughput, avg_mm_util, avg_mm_throughput, perfindex; 
@@ -169,16 +308,16 @@ int main(int argc, char **argv) {
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgalpCHsST:P:A:n:w:c:o:")) != EOF) {
         switch (c) {
         case 'g': /* Generate summary info for the autograder */
             autograder = 1;
             break;
-        case 'f': /* Use one specific trace file only (relative to curr dir) */
+        case 'f': /* Use one specific trace file only (relative to curr dir unless absolute) */
             num_tracefiles = 1;
             if ((tracefiles = realloc(tracefiles, 2 * sizeof(char *))) == NULL)
                 unix_error("ERROR: realloc failed in main");
-            strcpy(tracedir, "./");
+            strcpy(tracedir, (optarg[0] == '/') ? "" : "./");
             tracefiles[0] = strdup(optarg);
             tracefiles[1] = NULL;
             break;
@@ -195,6 +334,71 @@ int main(int argc, char **argv) {
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'C': /* Count cache misses and such per request with perf */
+            run_counters = 1;
+            break;
+        case 'H': /* Time every request and print latency percentiles */
+            run_hist = 1;
+            break;
+        case 's': /* Stream one big trace instead of the usual evaluation */
+            stream = 1;
+            break;
+        case 'S': /* Print the allocator's statistics for each trace */
+            run_stats = 1;
+            break;
+        case 'p': /* Partition the trace over the threads of -T */
+            partition = 1;
+            break;
+        case 'P': /* Evaluate mm with this placement policy, or all of them */
+            num_policies = 0;
+            for (int p = FIT_FIRST; p <= FIT_GOOD; p++)
+                if (!strcmp(optarg, "all") || !strcmp(optarg, policyname[p]))
+                    policies[num_policies++] = p;
+            if (num_policies == 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'A': /* Benchmark this allocator, with any others given */
+            if (num_allocs == MAX_ALLOCATORS) {
+                usage();
+                exit(1);
+            }
+            if (allocs == NULL && (allocs = calloc(MAX_ALLOCATORS, sizeof(allocator_t))) == NULL)
+                unix_error("allocs calloc in main failed");
+            allocator_get(&allocs[num_allocs++], optarg);
+            break;
+        case 'n': /* Timed trials per trace for -A */
+            trials = atoi(optarg);
+            if (trials < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'w': /* Warm-up runs per trace for -A */
+            warmup = atoi(optarg);
+            if (warmup < 0) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'c': /* Pin the -A harness to this CPU */
+            cpu = atoi(optarg);
+            break;
+        case 'o': /* Write the -A results to this CSV or JSON file */
+            outfile = optarg;
+            break;
+        case 'T': /* Replay on up to this many threads at once */
+            max_threads = atoi(optarg);
+            if (max_threads < 1 || max_threads > MAX_THREADS) {
+                usage();
+                exit(1);
+            }
+            if (max_threads > 1 && !mm_thread_safe) {
+                printf("-T %d needs mm.c built with MMFLAGS=-DMM_THREADS=1\n", max_threads);
+                exit(1);
+            }
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -210,6 +414,16 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (stream) {
+        if (tracefiles == NULL) {
+            printf("ERROR: -s needs a trace given with -f\n");
+            exit(1);
+        }
+        mem_init();
+        stream_trace(tracedir, tracefiles[0]);
+        exit(0);
+    }
+
     /*
      * Check and print team info
      */
@@ -259,6 +473,15 @@ int main(int argc, char **argv) {
         //printf("Using default tracefiles in %s\n", tracedir);
     }
 
+    /* The harness compares the allocators of -A instead of grading mm */
+    if (num_allocs > 0) {
+        mem_init();
+        mem_keep_warm(1); /* trials are timed from a heap with its pages in */
+        bench_all(allocs, num_allocs, tracefiles, num_tracefiles, trials, warmup, cpu, outfile);
+        free(allocs);
+        exit(0);
+    }
+
     if ((trace_weights = malloc(sizeof(int) * num_tracefiles)) == NULL) {
         unix_error("trace_weights malloc in main failed");
     }
@@ -317,85 +540,210 @@ int main(int argc, char **argv) {
     int max_heap, ideal_max_heap;
     int trial_counter;
     double prev_secs;
-    for (trial_counter = 0; trial_counter < NUM_TRIAL; trial_counter ++) {
+    int all_errors = 0; /* of every policy, for the runs that follow */
+    if (num_policies == 0) /* keep the policy mm.c was built with */
+        policies[num_policies++] = -1;
+
+    /* Initialize the simulated memory system in memlib.c; every trace
+       starts from an empty heap in the same reservation */
+    mem_init();
+
+    for (int p = 0; p < num_policies; p++) {
+        if (policies[p] >= 0 && mm_set_fit_policy(policies[p]) < 0)
+            app_error("mm_set_fit_policy rejected a placement policy");
+        memset(mm_stats, 0, num_tracefiles * sizeof(stats_t));
+        errors = 0; /* each policy is scored on its own */
+        for (trial_counter = 0; trial_counter < NUM_TRIAL; trial_counter ++) {
+            for (i = 0; i < num_tracefiles; i++) {
+                if (trial_counter == 0) {
+                    prev_secs = DBL_MAX;
+                } else {
+                    prev_secs = mm_stats[i].secs;
+                }
+                trace = read_trace(tracedir, tracefiles[i]);
+                trace_weights[i] = trace->weight;
+                mm_stats[i].ops = trace->num_ops;
+                mm_stats[i].filename = tracefiles[i];
+                if (verbose > 1)
+                    printf("Checking mm_malloc for correctness, ");
+                mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+                if (mm_stats[i].valid) {
+                    if (verbose > 1)
+                        printf("efficiency, ");
+                    mm_stats[i].util = eval_mm_util(trace, i, &ranges, &ideal_max_heap, &max_heap);
+
+                    mm_stats[i].max_heap = max_heap;
+                    mm_stats[i].ideal_max_heap = ideal_max_heap;
+                    speed_params.trace = trace;
+                    speed_params.ranges = ranges;
+                    if (verbose > 1)
+                        printf("and performance.\n");
+                    // get best speed, timing the allocator rather than page faults
+                    int warm = mem_keep_warm(1);
+                    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+                    mem_keep_warm(warm);
+                    if (mm_stats[i].secs > prev_secs) {
+                        mm_stats[i].secs = prev_secs;
+                    }
+                }
+                free_trace(trace);
+            }
+        }
 
-        /* Initialize the simulated memory system in memlib.c */
-        mem_init();
+        /* Display the mm results in a compact table, one per policy of -P */
+        if (verbose || num_policies > 1) {
+            if (policies[p] >= 0)
+                fprintf(result_fstream,"\nResults for mm malloc, %s fit:\n", policyname[policies[p]]);
+            else
+                fprintf(result_fstream,"\nResults for mm malloc:\n");
+            printresults(num_tracefiles, mm_stats);
+            fprintf(result_fstream,"\n");
+        }
+
+        /*
+         * Accumulate the aggregate statistics for the student's mm package
+         */
+        util = 0;
+        throughput = 0;
+        numcorrect = 0;
+        weight_sum = 0;
+        scaled_util = 0;
+
+        /* traces of weight 0 only count when there are no others */
+        for (i = 0; i < num_tracefiles; i++)
+            weight_sum += trace_weights[i];
+        for (i = 0; i < num_tracefiles; i++)
+            if (weight_sum == 0)
+                trace_weights[i] = 1;
+        weight_sum = 0;
 
         for (i = 0; i < num_tracefiles; i++) {
-            if (trial_counter == 0) {
-                prev_secs = DBL_MAX;
-            } else {
-                prev_secs = mm_stats[i].secs;
-            }
-            trace = read_trace(tracedir, tracefiles[i]);
-            trace_weights[i] = trace->weight;
-            mm_stats[i].ops = trace->num_ops;
-            mm_stats[i].filename = tracefiles[i];
-            if (verbose > 1)
-                printf("Checking mm_malloc for correctness, ");
-            mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-            if (mm_stats[i].valid) {
-                if (verbose > 1)
-                    printf("efficiency, ");
-                mm_stats[i].util = eval_mm_util(trace, i, &ranges, &ideal_max_heap, &max_heap);
+            util += mm_stats[i].util * trace_weights[i];
+            throughput += trace_weights[i] / (mm_stats[i].ops / 1000 / mm_stats[i].secs); // weighted harmonic mean 
+            weight_sum += trace_weights[i];
+            if (mm_stats[i].valid)
+                numcorrect++;
+        }
+        avg_mm_util = util / weight_sum;
+
+        /*
+         * Compute and print the performance index
+         */
+        if (errors == 0) {
+            avg_mm_throughput = weight_sum / throughput; // weighted harmonic mean
+
+            scaled_util = (avg_mm_util >= 0.6) ? (avg_mm_util - 0.6) / 0.4 : 0;
+            perfindex = scaled_util * scaled_util * avg_mm_throughput / 100;
+            fprintf(result_fstream,"Score = (%.3f [scaled util])^2 * (%.3f [avg Kops]) / 100 = %.0f/100\n",
+                   scaled_util,
+                   avg_mm_throughput,
+                   perfindex);
+        } else { /* There were errors */
+            perfindex = 0.0;
+            printf("Terminated with %d errors\n", errors);
+        }
+        all_errors += errors;
+    }
+    errors = all_errors;
 
-                mm_stats[i].max_heap = max_heap;
-                mm_stats[i].ideal_max_heap = ideal_max_heap;
-                speed_params.trace = trace;
-                speed_params.ranges = ranges;
-                if (verbose > 1)
-                    printf("and performance.\n");
-                // get best speed
-                mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-                if (mm_stats[i].secs > prev_secs) {
-                    mm_stats[i].secs = prev_secs;
-                }
-            }
+    /* The runs below time requests, which a fresh heap would fault into */
+    mem_keep_warm(1);
+
+    /*
+     * Optionally show what the allocator did on each trace
+     */
+    if (run_stats && errors == 0) {
+        for (i = 0; i < num_tracefiles; i++) {
+            printf("\nStatistics for %s at its peak:\n", tracefiles[i]);
+            trace = read_trace(tracedir, tracefiles[i]);
+            eval_mm_stats(trace);
             free_trace(trace);
         }
     }
 
-    /* Display the mm results in a compact table */
-    if (verbose) {
-        fprintf(result_fstream,"\nResults for mm malloc:\n");
-        printresults(num_tracefiles, mm_stats);
-        fprintf(result_fstream,"\n");
+    /*
+     * Optionally time every request of every trace
+     */
+    if (run_hist && errors == 0) {
+        static const char *opname[3] = {"malloc", "free", "realloc"};
+        hist_t *hist;
+        double overhead = timer_overhead();
+
+        if ((hist = malloc(3 * sizeof(hist_t))) == NULL)
+            unix_error("hist malloc in main failed");
+        printf("\nLatency results in cycles (timer overhead of %.0f cycles subtracted):\n",
+               overhead);
+        printf("%35s%9s%9s%9s%9s%9s%11s\n", "trace", "request", "count",
+               "p50", "p99", "p99.9", "max");
+        for (i = 0; i < num_tracefiles; i++) {
+            trace = read_trace(tracedir, tracefiles[i]);
+            eval_mm_latency(trace, hist, overhead);
+            for (int type = 0; type < 3; type++) {
+                if (hist[type].n == 0)
+                    continue;
+                printf("%35s%9s%9lu%9lu%9lu%9lu%11lu\n",
+                       type == 0 ? tracefiles[i] : "",
+                       opname[type],
+                       (unsigned long)hist[type].n,
+                       (unsigned long)hist_percentile(&hist[type], 0.50),
+                       (unsigned long)hist_percentile(&hist[type], 0.99),
+                       (unsigned long)hist_percentile(&hist[type], 0.999),
+                       (unsigned long)hist[type].max);
+            }
+            free_trace(trace);
+        }
+        free(hist);
     }
 
     /*
-     * Accumulate the aggregate statistics for the student's mm package
+     * Optionally count hardware events over one replay of every trace
      */
-    util = 0;
-    throughput = 0;
-    numcorrect = 0;
-    weight_sum = 0;
-    scaled_util = 0;
+    if (run_counters && errors == 0) {
+        int fd[NUM_COUNTERS];
+        double per_op[NUM_COUNTERS];
 
-    for (i = 0; i < num_tracefiles; i++) {
-        util += mm_stats[i].util * trace_weights[i];
-        throughput += trace_weights[i] / (mm_stats[i].ops / 1000 / mm_stats[i].secs); // weighted harmonic mean 
-        weight_sum += trace_weights[i];
-        if (mm_stats[i].valid)
-            numcorrect++;
+        if (counters_open(fd) == 0) {
+            printf("\nperf counters unavailable: %s\n", strerror(errno));
+        } else {
+            printf("\nHardware events per request (- where the event can't be counted):\n");
+            printf("%35s", "trace");
+            for (int e = 0; e < NUM_COUNTERS; e++)
+                printf("%11s", counter_events[e].name);
+            printf("\n");
+            for (i = 0; i < num_tracefiles; i++) {
+                trace = read_trace(tracedir, tracefiles[i]);
+                eval_mm_counters(trace, fd, per_op);
+                printf("%35s", tracefiles[i]);
+                for (int e = 0; e < NUM_COUNTERS; e++) {
+                    if (per_op[e] < 0)
+                        printf("%11s", "-");
+                    else
+                        printf("%11.2f", per_op[e]);
+                }
+                printf("\n");
+                free_trace(trace);
+            }
+            for (int e = 0; e < NUM_COUNTERS; e++)
+                if (fd[e] >= 0)
+                    close(fd[e]);
+        }
     }
-    avg_mm_util = util / weight_sum;
 
     /*
-     * Compute and print the performance index
+     * Optionally measure how the packages scale over threads
      */
-    if (errors == 0) {
-        avg_mm_throughput = weight_sum / throughput; // weighted harmonic mean
-
-        scaled_util = (avg_mm_util >= 0.6) ? (avg_mm_util - 0.6) / 0.4 : 0;
-        perfindex = scaled_util * scaled_util * avg_mm_throughput / 100;
-        fprintf(result_fstream,"Score = (%.3f [scaled util])^2 * (%.3f [avg Kops]) / 100 = %.0f/100\n",
-               scaled_util,
-               avg_mm_throughput,
-               perfindex);
-    } else { /* There were errors */
-        perfindex = 0.0;
-        printf("Terminated with %d errors\n", errors);
+    if (max_threads > 0 && errors == 0) {
+        printf("\nScaling results (%s of each trace per thread):\n",
+               partition ? "a partition" : "a copy");
+        printf("%35s%8s%8s%12s%12s%8s%8s%10s\n", "trace", "malloc",
+               "threads", "Kops/thread", "total Kops", "p50 ns", "p99 ns", "max ns");
+        for (i = 0; i < num_tracefiles; i++) {
+            trace = read_trace(tracedir, tracefiles[i]);
+            if (run_libc)
+                eval_scaling(tracefiles[i], trace, max_threads, partition, 1);
+            eval_scaling(tracefiles[i], trace, max_threads, partition, 0);
+            free_trace(trace);
+        }
     }
 
     if (autograder) {
@@ -403,27 +751,120 @@ int main(int argc, char **argv) {
         fprintf(result_fstream,"perfidx:%.0f\n", perfindex);
     }
 
+    free(libc_stats);
+    free(mm_stats);
+    free(trace_weights);
     fclose(result_fstream);    
 
     exit(0);
 }
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range tree, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.
+ *
+ * The tree is a treap keyed on lo. The ranges in it never overlap,
+ * so a new one overlaps some range iff it overlaps the range just
+ * below or just above it, and each check is O(log n). Nodes come from
+ * a pool that is reused from trace to trace.
  ****************************************************************/
 
+#define RANGE_CHUNK 4096 /* range records malloc'd at a time */
+
+typedef struct range_chunk_t {
+    struct range_chunk_t *next;
+    range_t nodes[RANGE_CHUNK];
+} range_chunk_t;
+
+static range_chunk_t *range_chunks; /* every chunk, in allocation order */
+static range_chunk_t *range_chunk;  /* the chunk being handed out */
+static int range_used;              /* nodes handed out from range_chunk */
+static range_t *range_free;         /* removed nodes, linked through left */
+static unsigned range_seed = 1;     /* for the treap priorities */
+
+/*
+ * range_alloc - Get a range record from the pool
+ */
+static range_t *range_alloc(void) {
+    range_t *p;
+
+    if ((p = range_free) != NULL) {
+        range_free = p->left;
+        return p;
+    }
+    if (range_chunk == NULL || range_used == RANGE_CHUNK) {
+        range_chunk_t *next = range_chunk ? range_chunk->next : range_chunks;
+        if (next == NULL) {
+            if ((next = (range_chunk_t *)malloc(sizeof(range_chunk_t))) == NULL)
+                unix_error("malloc error in add_range");
+            next->next = NULL;
+            if (range_chunk)
+                range_chunk->next = next;
+            else
+                range_chunks = next;
+        }
+        range_chunk = next;
+        range_used = 0;
+    }
+    return &range_chunk->nodes[range_used++];
+}
+
+/*
+ * range_split - Split tree t into the ranges below lo and the rest
+ */
+static void range_split(range_t *t, char *lo, range_t **below, range_t **rest) {
+    if (t == NULL) {
+        *below = *rest = NULL;
+    } else if (t->lo < lo) {
+        range_split(t->right, lo, &t->right, rest);
+        *below = t;
+    } else {
+        range_split(t->left, lo, below, &t->left);
+        *rest = t;
+    }
+}
+
+/*
+ * range_merge - Join two trees, every range of a being below those of b
+ */
+static range_t *range_merge(range_t *a, range_t *b) {
+    if (a == NULL)
+        return b;
+    if (b == NULL)
+        return a;
+    if (a->prio > b->prio) {
+        a->right = range_merge(a->right, b);
+        return a;
+    }
+    b->left = range_merge(a, b->left);
+    return b;
+}
+
+static range_t *range_insert(range_t *t, range_t *p) {
+    if (t == NULL)
+        return p;
+    if (p->prio > t->prio) {
+        range_split(t, p->lo, &p->left, &p->right);
+        return p;
+    }
+    if (p->lo < t->lo)
+        t->left = range_insert(t->left, p);
+    else
+        t->right = range_insert(t->right, p);
+    return t;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we create a range struct for this block and add it to the range tree.
  */
 static int add_range(range_t **ranges, char *lo, int size,
                      int tracenum, int opnum) {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *below = NULL, *above = NULL;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -436,36 +877,48 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* The payload must lie within the extent of the heap, or of a region from mem_map */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_is_mapped(lo, hi)) {
         sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
                 lo, hi, mem_heap_lo(), mem_heap_hi());
         malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges; p != NULL; p = p->next) {
-        if ((lo >= p->lo && lo <= p->hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-            sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-                    lo, hi, p->lo, p->hi);
-            malloc_error(tracenum, opnum, msg);
-            return 0;
+    /* The payload must not overlap the payloads next to it, hence any other */
+    for (p = *ranges; p != NULL;) {
+        if (p->lo <= lo) {
+            below = p;
+            p = p->right;
+        } else {
+            above = p;
+            p = p->left;
         }
     }
+    if (below != NULL && below->hi >= lo)
+        p = below;
+    else if (above != NULL && above->lo <= hi)
+        p = above;
+    if (p != NULL) {
+        sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+                lo, hi, p->lo, p->hi);
+        malloc_error(tracenum, opnum, msg);
+        return 0;
+    }
 
     /*
      * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-        unix_error("malloc error in add_range");
-    p->next = *ranges;
+    p = range_alloc();
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->left = p->right = NULL;
+    range_seed = range_seed * 1103515245 + 12345;
+    p->prio = range_seed;
+    *ranges = range_insert(*ranges, p);
     return 1;
 }
 
@@ -474,17 +927,13 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo) {
     range_t *p;
-    range_t **prevpp = ranges;
-    //int size;
 
-    for (p = *ranges; p != NULL; p = p->next) {
-        if (p->lo == lo) {
-            *prevpp = p->next;
-            //size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    while ((p = *ranges) != NULL && p->lo != lo)
+        ranges = (lo < p->lo) ? &p->left : &p->right;
+    if (p != NULL) {
+        *ranges = range_merge(p->left, p->right);
+        p->left = range_free;
+        range_free = p;
     }
 }
 
@@ -492,13 +941,8 @@ static void remove_range(range_t **ranges, char *lo) {
  * clear_ranges - free all of the range records for a trace
  */
 static void clear_ranges(range_t **ranges) {
-    range_t *p;
-    range_t *pnext;
-
-    for (p = *ranges; p != NULL; p = pnext) {
-        pnext = p->next;
-        free(p);
-    }
+    range_chunk = NULL;
+    range_free = NULL;
     *ranges = NULL;
 }
 
@@ -514,7 +958,7 @@ static trace_t *read_trace(char *tracedir, char *filename) {
     trace_t *trace;
     char type[MAXLINE];
     char path[500];
-    unsigned index, size;
+    unsigned index, size, align;
     unsigned max_index = 0;
     unsigned op_index;
 
@@ -532,6 +976,13 @@ static trace_t *read_trace(char *tracedir, char *filename) {
         sprintf(msg, "Could not open %s in read_trace", path);
         unix_error(msg);
     }
+    /* Binary traces are replayed straight out of a mapping of the file */
+    if (fscanf(tracefile, "%8s", type) == 1 && !strcmp(type, BINTRACE_MAGIC)) {
+        fclose(tracefile);
+        return map_bintrace(trace, path);
+    }
+    rewind(tracefile);
+    trace->map = NULL;
     fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
     fscanf(tracefile, "%d", &(trace->num_ids));
     fscanf(tracefile, "%d", &(trace->num_ops));
@@ -571,6 +1022,22 @@ static trace_t *read_trace(char *tracedir, char *filename) {
             trace->ops[op_index].size = size;
             max_index = (index > max_index) ? index : max_index;
             break;
+        case 'c':
+            fscanf(tracefile, "%u %u", &index, &size);
+            trace->ops[op_index].type = CALLOC;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 'm':
+            fscanf(tracefile, "%u %u %u", &index, &align, &size);
+            if (!op_set_memalign(&trace->ops[op_index], align, size)) {
+                printf("Bad alignment or size in tracefile %s\n", path);
+                exit(1);
+            }
+            trace->ops[op_index].index = index;
+            max_index = (index > max_index) ? index : max_index;
+            break;
         case 'f':
             fscanf(tracefile, "%ud", &index);
             trace->ops[op_index].type = FREE;
@@ -581,6 +1048,10 @@ static trace_t *read_trace(char *tracedir, char *filename) {
                    type[0], path);
             exit(1);
         }
+        if (index > TRACE_MAX_INDEX) {
+            printf("Bad id (%u) in tracefile %s\n", index, path);
+            exit(1);
+        }
         op_index++;
     }
     fclose(tracefile);
@@ -590,12 +1061,86 @@ static trace_t *read_trace(char *tracedir, char *filename) {
     return trace;
 }
 
+/*
+ * open_bintrace - Map the binary trace at path and check its header.
+ *     Returns the mapping, its size in *size.
+ */
+static bintrace_hdr_t *open_bintrace(char *path, size_t *size) {
+    int fd;
+    struct stat st;
+    bintrace_hdr_t *hdr;
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        sprintf(msg, "Could not open %s in open_bintrace", path);
+        unix_error(msg);
+    }
+    if ((size_t)st.st_size < sizeof(bintrace_hdr_t)) {
+        sprintf(msg, "Binary trace %s is truncated", path);
+        app_error(msg);
+    }
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED) {
+        sprintf(msg, "Could not map %s in open_bintrace", path);
+        unix_error(msg);
+    }
+    if (hdr->num_ops > ((size_t)st.st_size - sizeof(bintrace_hdr_t)) / sizeof(traceop_t)) {
+        sprintf(msg, "Binary trace %s is truncated", path);
+        app_error(msg);
+    }
+    *size = st.st_size;
+    return hdr;
+}
+
+/*
+ * map_bintrace - Fill in trace from the binary trace at path. The
+ *     requests are used in place, only blocks and block_sizes are copied.
+ *     Like read_trace, it takes only a file whose ids run up to the
+ *     last one its header counts.
+ */
+static trace_t *map_bintrace(trace_t *trace, char *path) {
+    bintrace_hdr_t *hdr = open_bintrace(path, &trace->map_size);
+    traceop_t *ops = (traceop_t *)(hdr + 1);
+    uint32_t max_index = 0;
+
+    if (hdr->num_ops > INT_MAX) {
+        sprintf(msg, "%s has too many requests to load, stream it with -s", path);
+        app_error(msg);
+    }
+    for (uint64_t i = 0; i < hdr->num_ops; i++) {
+        if (ops[i].type > MEMALIGN || ops[i].index >= hdr->num_ids) {
+            sprintf(msg, "Request %lu of %s is bogus or its id out of range",
+                    (unsigned long)i, path);
+            app_error(msg);
+        }
+        max_index = (ops[i].index > max_index) ? ops[i].index : max_index;
+    }
+    if (hdr->num_ops > 0 && max_index + 1 != hdr->num_ids) {
+        sprintf(msg, "%s has ids up to %u, its header %u", path, max_index, hdr->num_ids);
+        app_error(msg);
+    }
+    trace->map = hdr;
+    trace->sugg_heapsize = hdr->sugg_heapsize;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->weight = hdr->weight;
+    trace->ops = ops;
+    if ((trace->blocks = (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+        unix_error("malloc 3 failed in map_bintrace");
+    if ((trace->block_sizes = (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+        unix_error("malloc 4 failed in map_bintrace");
+    return trace;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
  *              to, all of which were allocated in read_trace().
  */
 void free_trace(trace_t *trace) {
-    free(trace->ops); /* free the three arrays... */
+    if (trace->map != NULL) /* free the three arrays... */
+        munmap(trace->map, trace->map_size);
+    else
+        free(trace->ops);
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace); /* and the trace record itself... */
@@ -606,6 +1151,46 @@ void free_trace(trace_t *trace) {
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * mm_request - Carry out an ALLOC, CALLOC or MEMALIGN request on the mm
+ *    package
+ */
+static inline void *mm_request(traceop_t op) {
+    switch (op.type) {
+    case CALLOC:
+        return mm_calloc(1, op.size);
+    case MEMALIGN:
+        return mm_memalign(op_align(op), op_size(op));
+    default:
+        return mm_malloc(op.size);
+    }
+}
+
+/*
+ * libc_request - Carry out an ALLOC, CALLOC or MEMALIGN request on libc
+ *    malloc
+ */
+static inline void *libc_request(traceop_t op) {
+    switch (op.type) {
+    case CALLOC:
+        return calloc(1, op.size);
+    case MEMALIGN:
+        return memalign(op_align(op), op_size(op));
+    default:
+        return malloc(op.size);
+    }
+}
+
+/*
+ * is_zero - True if the size bytes at p are all zero
+ */
+static int is_zero(const char *p, int size) {
+    for (int j = 0; j < size; j++)
+        if (p[j] != 0)
+            return 0;
+    return 1;
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -618,7 +1203,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
     char *oldp;
     char *p;
 
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
 
@@ -631,25 +1216,39 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
     /* Interpret each operation in the trace in order */
     for (i = 0; i < trace->num_ops; i++) {
         index = trace->ops[i].index;
-        size = trace->ops[i].size;
+        size = op_size(trace->ops[i]);
 
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
 
             /* Call the student's malloc */
-            if ((p = mm_malloc(size)) == NULL) {
+            if ((p = mm_request(trace->ops[i])) == NULL) {
                 malloc_error(tracenum, i, "mm_malloc failed.");
                 return 0;
             }
 
             /*
 	     * Test the range of the new block for correctness and add it
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range tree if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block.
 	     */
             if (add_range(ranges, p, size, tracenum, i) == 0)
                 return 0;
+            if (mm_usable_size(p) < (size_t)size) {
+                malloc_error(tracenum, i, "mm_usable_size is below the size asked for.");
+                return 0;
+            }
+            if (trace->ops[i].type == CALLOC && !is_zero(p, size)) {
+                malloc_error(tracenum, i, "mm_calloc did not zero the block.");
+                return 0;
+            }
+            if (trace->ops[i].type == MEMALIGN && (uintptr_t)p % op_align(trace->ops[i]) != 0) {
+                malloc_error(tracenum, i, "mm_memalign did not align the block.");
+                return 0;
+            }
 
             /* ADDED: cgw
 	     * fill range with low byte of index.  This will be used later
@@ -672,12 +1271,16 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
                 return 0;
             }
 
-            /* Remove the old region from the range list */
+            /* Remove the old region from the range tree */
             remove_range(ranges, oldp);
 
-            /* Check new block for correctness and add it to range list */
+            /* Check new block for correctness and add it to range tree */
             if (add_range(ranges, newp, size, tracenum, i) == 0)
                 return 0;
+            if (mm_usable_size(newp) < (size_t)size) {
+                malloc_error(tracenum, i, "mm_usable_size is below the size asked for.");
+                return 0;
+            }
 
             /* ADDED: cgw
 	     * Make sure that the new block contains the data from the old
@@ -688,7 +1291,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
             if (size < oldsize)
                 oldsize = size;
             for (j = 0; j < oldsize; j++) {
-                if (newp[j] != (index & 0xFF)) {
+                if ((unsigned char)newp[j] != (index & 0xFF)) {
                     malloc_error(tracenum, i, "mm_realloc did not preserve the "
                                               "data from old block");
                     return 0;
@@ -703,15 +1306,28 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
 
         case FREE: /* mm_free */
 
-            /* Remove region from list and call student's free function */
+            /* Remove region from list and call student's free function,
+               telling it the size as well */
             p = trace->blocks[index];
             remove_range(ranges, p);
-            mm_free(p);
+            mm_free_sized(p, trace->block_sizes[index]);
             break;
 
         default:
             app_error("Nonexistent request type in eval_mm_valid");
         }
+
+        /* Check a few more blocks of the heap, going round it over the trace */
+        if (mm_checkheap_step(CHECK_STEP) != 0) {
+            malloc_error(tracenum, i, "mm_checkheap_step found errors.");
+            return 0;
+        }
+    }
+
+    /* The heap the trace leaves behind has to check out too */
+    if (mm_checkheap(0) != 0) {
+        malloc_error(tracenum, trace->num_ops - 1, "mm_checkheap found errors after the trace.");
+        return 0;
     }
 
     /* As far as we know, this is a valid malloc package */
@@ -723,10 +1339,9 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) {
  *   The idea is to remember the high water mark "hwm" of the heap for
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
- *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   largest size of the heap in bytes while running the student's
+ *   malloc package on the trace. mem_sbrk() lets the package shrink
+ *   the heap, so that is mem_peak_heapsize(), not the final size.
  *
  */
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, int *ideal_max_heap, int *max_heap) {
@@ -745,15 +1360,16 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, int *
 
     for (i = 0; i < trace->num_ops; i++) {
         void *old_lo = mem_heap_lo();
-        void *old_hi = mem_heap_hi();
 
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
             index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            size = op_size(trace->ops[i]);
 
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = mm_request(trace->ops[i])) == NULL)
                 app_error("mm_malloc failed in eval_mm_util");
 
             /* Remember region and size */
@@ -805,11 +1421,11 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, int *
         default:
             app_error("Nonexistent request type in eval_mm_util");
         }
-        if (old_lo != mem_heap_lo() || old_hi > mem_heap_hi())
-            app_error("Error, tampering with mem_heap_lo/hi");
+        if (old_lo != mem_heap_lo())
+            app_error("Error, tampering with mem_heap_lo");
     }
 
-    *max_heap = mem_heapsize() > FREE_HEAP ? mem_heapsize() : FREE_HEAP;
+    *max_heap = mem_peak_heapsize() > FREE_HEAP ? mem_peak_heapsize() : FREE_HEAP;
     *ideal_max_heap = max_total_size;
     return ((double)*ideal_max_heap / (double)*max_heap);
 }
@@ -819,7 +1435,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges, int *
  *    to measure the running time of the mm malloc package.
  */
 static void eval_mm_speed(void *ptr) {
-    int i, index, size, newsize;
+    int i, index, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -833,9 +1449,10 @@ static void eval_mm_speed(void *ptr) {
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
             index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = mm_request(trace->ops[i])) == NULL)
                 app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
@@ -860,6 +1477,564 @@ static void eval_mm_speed(void *ptr) {
         }
 }
 
+/*
+ * replay_now - Monotonic time in ns, for timing single requests
+ */
+static inline uint64_t replay_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * parse_ops - Read up to max requests of a .rep file into ops, one line
+ *    at a time. Returns how many were read, 0 at the end of the file.
+ */
+static int parse_ops(FILE *tracefile, traceop_t *ops, int max, char *path) {
+    char line[MAXLINE], *p;
+    int n = 0;
+
+    while (n < max && fgets(line, sizeof(line), tracefile) != NULL) {
+        for (p = line; isspace((unsigned char)*p); p++)
+            ;
+        if (*p == '\0')
+            continue;
+        switch (*p) {
+        case 'a':
+            ops[n].type = ALLOC;
+            break;
+        case 'r':
+            ops[n].type = REALLOC;
+            break;
+        case 'c':
+            ops[n].type = CALLOC;
+            break;
+        case 'm':
+            ops[n].type = MEMALIGN;
+            break;
+        case 'f':
+            ops[n].type = FREE;
+            break;
+        default:
+            printf("Bogus type character (%c) in tracefile %s\n", *p, path);
+            exit(1);
+        }
+        unsigned long index = strtoul(p + 1, &p, 10);
+        if (index > TRACE_MAX_INDEX) {
+            printf("Bad id (%lu) in tracefile %s\n", index, path);
+            exit(1);
+        }
+        ops[n].index = index;
+        if (ops[n].type == MEMALIGN) {
+            unsigned long align = strtoul(p, &p, 10);
+            if (!op_set_memalign(&ops[n], align, strtoul(p, &p, 10))) {
+                printf("Bad alignment or size in tracefile %s\n", path);
+                exit(1);
+            }
+        } else {
+            ops[n].size = (ops[n].type == FREE) ? 0 : strtoul(p, &p, 10);
+        }
+        n++;
+    }
+    return n;
+}
+
+/*
+ * stream_replay - Replay n requests on the mm package, the first being
+ *    request first of the trace, checking the payloads against ranges
+ *    as eval_mm_valid does. Keeps the live payload bytes in *live and
+ *    their high water mark in *peak.
+ */
+static void stream_replay(traceop_t *ops, int n, uint64_t first, uint32_t num_ids,
+                          char **blocks, size_t *sizes, range_t **ranges,
+                          size_t *live, size_t *peak, uint64_t *ns) {
+    int i;
+    uint32_t index, size;
+    uint64_t begin;
+    char *p;
+
+    for (i = 0; i < n; i++) {
+        index = ops[i].index;
+        if (index >= num_ids)
+            app_error("Request id out of range in stream_replay");
+        switch (ops[i].type) {
+        case ALLOC:
+        case CALLOC:
+        case MEMALIGN:
+        case REALLOC:
+            size = op_size(ops[i]);
+            begin = replay_now();
+            p = (ops[i].type == REALLOC) ? mm_realloc(blocks[index], size)
+                                         : mm_request(ops[i]);
+            *ns += replay_now() - begin;
+            if (p == NULL)
+                app_error("mm_malloc or mm_realloc failed in stream_replay");
+            if (ops[i].type == REALLOC)
+                remove_range(ranges, blocks[index]);
+            if (size > 0 && add_range(ranges, p, size, 0, first + i) == 0)
+                app_error("Invalid payload in stream_replay");
+            if (ops[i].type == CALLOC && !is_zero(p, size))
+                app_error("mm_calloc did not zero the block in stream_replay");
+            if (ops[i].type == MEMALIGN && (uintptr_t)p % op_align(ops[i]) != 0)
+                app_error("mm_memalign did not align the block in stream_replay");
+            *live += size - (ops[i].type == REALLOC ? sizes[index] : 0);
+            blocks[index] = p;
+            sizes[index] = size;
+            break;
+
+        case FREE:
+            remove_range(ranges, blocks[index]);
+            begin = replay_now();
+            mm_free(blocks[index]);
+            *ns += replay_now() - begin;
+            *live -= sizes[index];
+            sizes[index] = 0;
+            break;
+
+        default:
+            app_error("Nonexistent request type in stream_replay");
+        }
+        if (*live > *peak)
+            *peak = *live;
+    }
+}
+
+/*
+ * stream_trace - Replay a trace that may not fit in memory, STREAM_CHUNK
+ *    requests at a time. Binary traces are mapped and each chunk is
+ *    dropped from memory once replayed; .rep files are parsed chunk by
+ *    chunk. Only the time spent in the mm package is counted, each
+ *    request being timed on its own.
+ */
+static void stream_trace(char *tracedir, char *filename) {
+    char path[500];
+    char **blocks;
+    size_t *sizes;
+    size_t live = 0, peak = 0;
+    range_t *ranges = NULL;
+    uint32_t num_ids;
+    uint64_t total_ops = 0, nchunks = 0, ns = 0;
+    bintrace_hdr_t *hdr = NULL;
+    size_t map_size = 0;
+    FILE *tracefile;
+    traceop_t *ops = NULL;
+    char type[MAXLINE];
+    int n, sugg_heapsize, ids, num_ops, weight;
+
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    if ((tracefile = fopen(path, "r")) == NULL) {
+        sprintf(msg, "Could not open %s in stream_trace", path);
+        unix_error(msg);
+    }
+    if (fscanf(tracefile, "%8s", type) == 1 && !strcmp(type, BINTRACE_MAGIC)) {
+        hdr = open_bintrace(path, &map_size);
+        num_ids = hdr->num_ids;
+        madvise(hdr, map_size, MADV_SEQUENTIAL);
+    } else {
+        rewind(tracefile);
+        if (fscanf(tracefile, "%d %d %d %d", &sugg_heapsize, &ids, &num_ops, &weight) != 4)
+            app_error("Bad trace header in stream_trace");
+        num_ids = ids;
+        if ((ops = malloc(STREAM_CHUNK * sizeof(traceop_t))) == NULL)
+            unix_error("malloc failed in stream_trace");
+    }
+    if ((blocks = calloc(num_ids, sizeof(char *))) == NULL ||
+        (sizes = calloc(num_ids, sizeof(size_t))) == NULL)
+        unix_error("calloc failed in stream_trace");
+
+    mem_reset_brk();
+    clear_ranges(&ranges);
+    if (mm_init() < 0)
+        app_error("mm_init failed in stream_trace");
+    for (;;) {
+        if (hdr != NULL) {
+            if (total_ops == hdr->num_ops)
+                break;
+            ops = (traceop_t *)(hdr + 1) + total_ops;
+            n = (hdr->num_ops - total_ops < STREAM_CHUNK) ? hdr->num_ops - total_ops : STREAM_CHUNK;
+        } else if ((n = parse_ops(tracefile, ops, STREAM_CHUNK, path)) == 0) {
+            break;
+        }
+        stream_replay(ops, n, total_ops, num_ids, blocks, sizes, &ranges, &live, &peak, &ns);
+        if (hdr != NULL) {
+            /* give the replayed pages back, the kernel can reread them */
+            char *lo = (char *)hdr + ((((char *)ops - (char *)hdr)) & ~(size_t)(getpagesize() - 1));
+            madvise(lo, (char *)(ops + n) - lo, MADV_DONTNEED);
+        }
+        total_ops += n;
+        nchunks++;
+    }
+    if (hdr == NULL && total_ops != (uint64_t)num_ops) {
+        sprintf(msg, "%s has %lu requests, its header %d", path, (unsigned long)total_ops, num_ops);
+        app_error(msg);
+    }
+
+    size_t heap = mem_peak_heapsize() > FREE_HEAP ? mem_peak_heapsize() : FREE_HEAP;
+    printf("%s: %lu requests in %lu chunks, %.6f secs, %.0f Kops, util %.0f%% "
+           "(peak payload %luk, peak heap %luk)\n",
+           filename, (unsigned long)total_ops, (unsigned long)nchunks, ns / 1e9,
+           ns ? total_ops / 1e3 / (ns / 1e9) : 0.0, 100.0 * peak / heap,
+           (unsigned long)(peak / 1024), (unsigned long)(heap / 1024));
+
+    fclose(tracefile);
+    if (hdr != NULL)
+        munmap(hdr, map_size);
+    else
+        free(ops);
+    free(blocks);
+    free(sizes);
+}
+
+/*
+ * eval_mm_stats - Replay trace on the mm package up to the request after
+ *    which the most payload bytes are live, then print mm_stats. The
+ *    counters cover that part of the trace, fragmentation is at the peak.
+ */
+static void eval_mm_stats(trace_t *trace) {
+    int i, index, peak = 0;
+    long total = 0, max_total = -1;
+    char *p;
+
+    /* find the peak from the trace alone */
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+        case ALLOC:
+        case CALLOC:
+        case MEMALIGN:
+            total += op_size(trace->ops[i]);
+            trace->block_sizes[index] = op_size(trace->ops[i]);
+            break;
+        case REALLOC:
+            total += trace->ops[i].size - (long)trace->block_sizes[index];
+            trace->block_sizes[index] = trace->ops[i].size;
+            break;
+        case FREE:
+            total -= trace->block_sizes[index];
+            break;
+        }
+        if (total > max_total) {
+            max_total = total;
+            peak = i;
+        }
+    }
+
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_stats");
+    for (i = 0; i <= peak; i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+        case ALLOC:
+        case CALLOC:
+        case MEMALIGN:
+            if ((p = mm_request(trace->ops[i])) == NULL)
+                app_error("mm_malloc error in eval_mm_stats");
+            trace->blocks[index] = p;
+            break;
+        case REALLOC:
+            if ((p = mm_realloc(trace->blocks[index], trace->ops[i].size)) == NULL)
+                app_error("mm_realloc error in eval_mm_stats");
+            trace->blocks[index] = p;
+            break;
+        case FREE:
+            mm_free(trace->blocks[index]);
+            break;
+        }
+    }
+    mm_stats();
+}
+
+/*
+ * timer_overhead - Cycles a start_counter/get_counter pair costs on its
+ *    own. The smallest of many samples, as anything above it is noise.
+ */
+static double timer_overhead(void) {
+    double best = DBL_MAX;
+
+    for (int i = 0; i < 1000; i++) {
+        double c = ovhd();
+        if (c < best)
+            best = c;
+    }
+    return best;
+}
+
+/*
+ * counters_open - Open a disabled counter for each of counter_events,
+ *    fd -1 for those this machine can't count. Returns how many opened.
+ */
+static int counters_open(int fd[NUM_COUNTERS]) {
+    struct perf_event_attr attr;
+    int opened = 0, err = 0;
+
+    for (int e = 0; e < NUM_COUNTERS; e++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_events[e].type;
+        attr.config = counter_events[e].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* the counters may take turns on the PMU, scale by time counted */
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fd[e] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd[e] >= 0)
+            opened++;
+        else
+            err = errno;
+    }
+    errno = err; /* why the last one failed */
+    return opened;
+}
+
+/*
+ * eval_mm_counters - Replay trace on the mm package once with the
+ *    counters of fd running, and set per_op[e] to how many of event e
+ *    each request cost on average, or -1 if it wasn't counted.
+ */
+static void eval_mm_counters(trace_t *trace, int fd[NUM_COUNTERS], double per_op[NUM_COUNTERS]) {
+    speed_t params = {trace, NULL};
+    uint64_t value[3]; /* count, time enabled, time running */
+
+    for (int e = 0; e < NUM_COUNTERS; e++)
+        if (fd[e] >= 0)
+            ioctl(fd[e], PERF_EVENT_IOC_RESET, 0);
+    for (int e = 0; e < NUM_COUNTERS; e++)
+        if (fd[e] >= 0)
+            ioctl(fd[e], PERF_EVENT_IOC_ENABLE, 0);
+    eval_mm_speed(&params);
+    for (int e = 0; e < NUM_COUNTERS; e++)
+        if (fd[e] >= 0)
+            ioctl(fd[e], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (int e = 0; e < NUM_COUNTERS; e++) {
+        per_op[e] = -1;
+        if (fd[e] < 0 || read(fd[e], value, sizeof(value)) != sizeof(value) || value[2] == 0)
+            continue;
+        per_op[e] = (double)value[0] * value[1] / value[2] / trace->num_ops;
+    }
+}
+
+/*
+ * hist_bucket - Bucket holding value, see HIST_SUB
+ */
+static inline int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB)
+        return value;
+    int e = 63 - __builtin_clzll(value);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB + ((value >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * hist_top - Largest value that lands in bucket b
+ */
+static uint64_t hist_top(int b) {
+    if (b < HIST_SUB)
+        return b;
+    int e = b / HIST_SUB + HIST_SUB_BITS - 1;
+    uint64_t lo = (uint64_t)(HIST_SUB + b % HIST_SUB) << (e - HIST_SUB_BITS);
+    return lo + ((uint64_t)1 << (e - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_record(hist_t *h, uint64_t value) {
+    h->count[hist_bucket(value)]++;
+    h->n++;
+    if (value > h->max)
+        h->max = value;
+}
+
+/*
+ * hist_percentile - Smallest bucket bound at or above fraction p of the
+ *    recorded values, capped at the exact maximum
+ */
+static uint64_t hist_percentile(hist_t *h, double p) {
+    uint64_t rank = (uint64_t)(p * h->n), seen = 0;
+
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen > rank)
+            return hist_top(b) < h->max ? hist_top(b) : h->max;
+    }
+    return h->max;
+}
+
+/*
+ * eval_mm_latency - Replay trace on the mm package timing every request
+ *    with the cycle counter, into hist[0] (malloc), hist[1] (free) and
+ *    hist[2] (realloc). overhead is taken off each sample.
+ */
+static void eval_mm_latency(trace_t *trace, hist_t hist[3], double overhead) {
+    int i, index;
+    char *p;
+    double cycles;
+
+    memset(hist, 0, 3 * sizeof(hist_t));
+    mem_reset_brk();
+    if (mm_init() < 0)
+        app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+        case ALLOC:
+        case CALLOC:
+        case MEMALIGN:
+            start_counter();
+            p = mm_request(trace->ops[i]);
+            cycles = get_counter();
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            hist_record(&hist[0], cycles > overhead ? cycles - overhead : 0);
+            break;
+
+        case FREE:
+            p = trace->blocks[index];
+            start_counter();
+            mm_free(p);
+            cycles = get_counter();
+            hist_record(&hist[1], cycles > overhead ? cycles - overhead : 0);
+            break;
+
+        case REALLOC:
+            start_counter();
+            p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+            cycles = get_counter();
+            if (p == NULL)
+                app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            hist_record(&hist[2], cycles > overhead ? cycles - overhead : 0);
+            break;
+        }
+    }
+}
+
+/*
+ * eval_replay_thread - Body of one thread of a multi-threaded replay.
+ *    Waits for the others, then replays its requests and times each one.
+ */
+static void *eval_replay_thread(void *ptr) {
+    replay_t *r = ptr;
+    trace_t *trace = r->trace;
+    int i, index;
+    char *p;
+    uint64_t begin, t0, t1;
+
+    pthread_barrier_wait(r->start);
+    begin = replay_now();
+    r->nops = 0;
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        if (r->partition && index % r->nthreads != r->tid)
+            continue;
+
+        t0 = replay_now();
+        switch (trace->ops[i].type) {
+        case ALLOC:
+        case CALLOC:
+        case MEMALIGN:
+            p = r->use_libc ? libc_request(trace->ops[i]) : mm_request(trace->ops[i]);
+            if (p == NULL)
+                app_error("malloc failed in eval_replay_thread");
+            r->blocks[index] = p;
+            break;
+
+        case REALLOC:
+            p = r->use_libc ? realloc(r->blocks[index], trace->ops[i].size)
+                            : mm_realloc(r->blocks[index], trace->ops[i].size);
+            if (p == NULL)
+                app_error("realloc failed in eval_replay_thread");
+            r->blocks[index] = p;
+            break;
+
+        case FREE:
+            if (r->use_libc)
+                free(r->blocks[index]);
+            else
+                mm_free(r->blocks[index]);
+            break;
+        }
+        t1 = replay_now();
+        r->lat[r->nops++] = (t1 - t0 > UINT32_MAX) ? UINT32_MAX : (uint32_t)(t1 - t0);
+    }
+    r->secs = (replay_now() - begin) / 1e9;
+    return NULL;
+}
+
+static int cmp_lat(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * eval_scaling - Replay trace (read from filename) on 1..max_threads threads at the same time
+ *    and print one line per thread count: mean throughput of a thread,
+ *    aggregate throughput over the wall clock time, and the latency
+ *    percentiles of all requests. mm.c must be built thread safe
+ *    (MMFLAGS=-DMM_THREADS=1) for more than one thread.
+ */
+static void eval_scaling(char *filename, trace_t *trace, int max_threads, int partition, int use_libc) {
+    replay_t r[MAX_THREADS];
+    pthread_t tid[MAX_THREADS];
+    pthread_barrier_t start;
+    uint32_t *lat;
+    int n, t, nlat;
+
+    if ((lat = malloc((size_t)max_threads * trace->num_ops * sizeof(uint32_t))) == NULL)
+        unix_error("malloc failed in eval_scaling");
+
+    for (n = 1; n <= max_threads; n++) {
+        if (!use_libc) {
+            mem_reset_brk();
+            if (mm_init() < 0)
+                app_error("mm_init failed in eval_scaling");
+        }
+        pthread_barrier_init(&start, NULL, n + 1);
+        for (t = 0; t < n; t++) {
+            r[t].trace = trace;
+            r[t].use_libc = use_libc;
+            r[t].partition = partition;
+            r[t].tid = t;
+            r[t].nthreads = n;
+            r[t].lat = lat + (size_t)t * trace->num_ops;
+            r[t].start = &start;
+            if ((r[t].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+                unix_error("calloc failed in eval_scaling");
+            if (pthread_create(&tid[t], NULL, eval_replay_thread, &r[t]) != 0)
+                unix_error("pthread_create failed in eval_scaling");
+        }
+        pthread_barrier_wait(&start);
+        uint64_t begin = replay_now();
+        for (t = 0; t < n; t++)
+            pthread_join(tid[t], NULL);
+        double wall = (replay_now() - begin) / 1e9;
+        pthread_barrier_destroy(&start);
+
+        /* gather every thread's latencies for the percentiles */
+        double thread_kops = 0;
+        nlat = 0;
+        for (t = 0; t < n; t++) {
+            thread_kops += r[t].nops / 1e3 / r[t].secs;
+            memmove(lat + nlat, r[t].lat, r[t].nops * sizeof(uint32_t));
+            nlat += r[t].nops;
+            free(r[t].blocks);
+        }
+        qsort(lat, nlat, sizeof(uint32_t), cmp_lat);
+        printf("%35s%8s%8d%12.0f%12.0f%8u%8u%10u\n",
+               n == 1 ? filename : "",
+               use_libc ? "libc" : "mm",
+               n,
+               thread_kops / n,
+               nlat / 1e3 / wall,
+               lat[nlat / 2],
+               lat[(int)(nlat * 0.99)],
+               lat[nlat - 1]);
+    }
+    free(lat);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -874,7 +2049,9 @@ static int eval_libc_valid(trace_t *trace, int tracenum) {
         switch (trace->ops[i].type) {
 
         case ALLOC: /* malloc */
-            if ((p = malloc(trace->ops[i].size)) == NULL) {
+        case CALLOC: /* calloc */
+        case MEMALIGN: /* memalign */
+            if ((p = libc_request(trace->ops[i])) == NULL) {
                 malloc_error(tracenum, i, "libc malloc failed");
                 unix_error("System message");
             }
@@ -910,16 +2087,17 @@ static int eval_libc_valid(trace_t *trace, int tracenum) {
  */
 static void eval_libc_speed(void *ptr) {
     int i;
-    int index, size, newsize;
+    int index, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     for (i = 0; i < trace->num_ops; i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
+        case CALLOC: /* calloc */
+        case MEMALIGN: /* memalign */
             index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = malloc(size)) == NULL)
+            if ((p = libc_request(trace->ops[i])) == NULL)
                 unix_error("malloc failed in eval_libc_speed");
             trace->blocks[index] = p;
             break;
@@ -943,6 +2121,283 @@ static void eval_libc_speed(void *ptr) {
     }
 }
 
+/*****************************************************************
+ * The benchmark harness (-A) runs each trace on each allocator in
+ * warm-up runs and then timed trials, each from an empty heap, and
+ * reports the mean throughput with a 95% confidence interval next to
+ * the utilization.
+ ****************************************************************/
+
+static int libc_init(void) {
+    return 0;
+}
+
+/*
+ * allocator_get - Set up alloc from spec, mm, libc or the path of a
+ *    shared object exporting the mm and memlib interface (make mm.so),
+ *    which is named after its file. ":first", ":best" or ":good" after
+ *    an mm runs it with that placement policy.
+ */
+static void allocator_get(allocator_t *alloc, const char *spec) {
+    static const char *policyname[3] = {"first", "best", "good"};
+    char path[MAXLINE];
+    char *colon;
+
+    memset(alloc, 0, sizeof(*alloc));
+    snprintf(path, sizeof(path), "%s", spec);
+    alloc->policy = -1;
+    if ((colon = strrchr(path, ':')) != NULL) {
+        *colon = '\0';
+        for (int p = FIT_FIRST; p <= FIT_GOOD; p++)
+            if (!strcmp(colon + 1, policyname[p]))
+                alloc->policy = p;
+        if (alloc->policy < 0 || !strcmp(path, "libc")) {
+            usage();
+            exit(1);
+        }
+    }
+    if (!strcmp(path, "libc")) {
+        alloc->init = libc_init;
+        alloc->malloc = malloc;
+        alloc->calloc = calloc;
+        alloc->memalign = memalign;
+        alloc->free = free;
+        alloc->realloc = realloc;
+    } else if (!strcmp(path, "mm")) {
+        alloc->set_policy = mm_set_fit_policy;
+        alloc->reset = mem_reset_brk;
+        alloc->init = mm_init;
+        alloc->malloc = mm_malloc;
+        alloc->calloc = mm_calloc;
+        alloc->memalign = mm_memalign;
+        alloc->free = mm_free;
+        alloc->realloc = mm_realloc;
+        alloc->peak = mem_peak_heapsize;
+    } else {
+        /* RTLD_LOCAL keeps its mm_malloc and mem_sbrk apart from ours */
+        void *so = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+        if (so == NULL) {
+            printf("ERROR: could not load %s: %s\n", path, dlerror());
+            exit(1);
+        }
+        void (*so_mem_init)(void) = (void (*)(void))dlsym(so, "mem_init");
+        alloc->set_policy = (int (*)(int))dlsym(so, "mm_set_fit_policy");
+        alloc->reset = (void (*)(void))dlsym(so, "mem_reset_brk");
+        alloc->init = (int (*)(void))dlsym(so, "mm_init");
+        alloc->malloc = (void *(*)(size_t))dlsym(so, "mm_malloc");
+        alloc->calloc = (void *(*)(size_t, size_t))dlsym(so, "mm_calloc");
+        alloc->memalign = (void *(*)(size_t, size_t))dlsym(so, "mm_memalign");
+        alloc->free = (void (*)(void *))dlsym(so, "mm_free");
+        alloc->realloc = (void *(*)(void *, size_t))dlsym(so, "mm_realloc");
+        alloc->peak = (size_t(*)(void))dlsym(so, "mem_peak_heapsize");
+        if (!so_mem_init || !alloc->reset || !alloc->init || !alloc->malloc || !alloc->calloc || !alloc->memalign ||
+            !alloc->free ||
+            !alloc->realloc || (alloc->policy >= 0 && !alloc->set_policy)) {
+            printf("ERROR: %s doesn't export the mm and memlib interface\n", path);
+            exit(1);
+        }
+        so_mem_init();
+        int (*so_keep_warm)(int) = (int (*)(int))dlsym(so, "mem_keep_warm");
+        if (so_keep_warm)
+            so_keep_warm(1);
+    }
+    const char *base = strrchr(spec, '/');
+    snprintf(alloc->name, sizeof(alloc->name), "%s", base ? base + 1 : spec);
+}
+
+/*
+ * bench_replay - Replay trace on alloc from an empty heap, leaving the
+ *    blocks still live at its end in trace->blocks
+ */
+static void bench_replay(allocator_t *alloc, trace_t *trace) {
+    int i, index;
+    char *p;
+
+    if (alloc->reset)
+        alloc->reset();
+    if (alloc->init() < 0)
+        app_error("init failed in bench_replay");
+    for (i = 0; i < trace->num_ops; i++) {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+        case ALLOC:
+            if ((p = alloc->malloc(trace->ops[i].size)) == NULL)
+                app_error("malloc failed in bench_replay");
+            trace->blocks[index] = p;
+            break;
+        case CALLOC:
+            if ((p = alloc->calloc(1, trace->ops[i].size)) == NULL)
+                app_error("calloc failed in bench_replay");
+            trace->blocks[index] = p;
+            break;
+        case MEMALIGN:
+            if ((p = alloc->memalign(op_align(trace->ops[i]), op_size(trace->ops[i]))) == NULL)
+                app_error("memalign failed in bench_replay");
+            trace->blocks[index] = p;
+            break;
+        case REALLOC:
+            if ((p = alloc->realloc(trace->blocks[index], trace->ops[i].size)) == NULL)
+                app_error("realloc failed in bench_replay");
+            trace->blocks[index] = p;
+            break;
+        case FREE:
+            alloc->free(trace->blocks[index]);
+            trace->blocks[index] = NULL;
+            break;
+        }
+    }
+}
+
+/*
+ * bench_cleanup - Free what bench_replay left live, so an allocator that
+ *    can't be reset (libc) starts the next run from the same heap
+ */
+static void bench_cleanup(allocator_t *alloc, trace_t *trace) {
+    for (int i = 0; i < trace->num_ids; i++) {
+        if (trace->blocks[i] != NULL)
+            alloc->free(trace->blocks[i]);
+        trace->blocks[i] = NULL;
+    }
+}
+
+/*
+ * t95 - Two sided 95% quantile of Student's t with df degrees of freedom
+ */
+static double t95(int df) {
+    static const double t[30] = {12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+                                 2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+                                 2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+                                 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    return df <= 30 ? t[df - 1] : 1.960;
+}
+
+/*
+ * bench_trace - Measure alloc on trace: utilization from one run, then
+ *    throughput over trials timed runs after warmup untimed ones
+ */
+static void bench_trace(allocator_t *alloc, trace_t *trace, int trials, int warmup, bench_t *b) {
+    double sum = 0, sumsq = 0;
+    size_t live = 0, peak_live = FREE_HEAP;
+
+    /* the peak of live payload bytes is the same for every allocator */
+    memset(trace->block_sizes, 0, trace->num_ids * sizeof(size_t));
+    for (int i = 0; i < trace->num_ops; i++) {
+        int index = trace->ops[i].index;
+        live -= trace->block_sizes[index];
+        trace->block_sizes[index] = trace->ops[i].type == FREE ? 0 : op_size(trace->ops[i]);
+        live += trace->block_sizes[index];
+        if (live > peak_live)
+            peak_live = live;
+    }
+    int old_policy = -1; /* put back once done, so plain mm keeps its own */
+    if (alloc->set_policy && alloc->policy >= 0 &&
+        (old_policy = alloc->set_policy(alloc->policy)) < 0)
+        app_error("the allocator rejected a placement policy");
+
+    memset(trace->blocks, 0, trace->num_ids * sizeof(char *));
+    bench_replay(alloc, trace);
+    /* heap and payload are both floored at FREE_HEAP, as in eval_mm_util */
+    size_t peak = alloc->peak ? alloc->peak() : 0;
+    b->util = (peak > 0) ? (double)peak_live / (peak > FREE_HEAP ? peak : FREE_HEAP) : -1;
+    bench_cleanup(alloc, trace);
+
+    b->kops_min = DBL_MAX;
+    b->kops_max = 0;
+    for (int run = 0; run < warmup + trials; run++) {
+        uint64_t begin = replay_now();
+        bench_replay(alloc, trace);
+        double secs = (replay_now() - begin) / 1e9;
+        bench_cleanup(alloc, trace);
+        if (run < warmup)
+            continue;
+        double kops = trace->num_ops / secs / 1e3;
+        sum += kops;
+        sumsq += kops * kops;
+        if (kops < b->kops_min)
+            b->kops_min = kops;
+        if (kops > b->kops_max)
+            b->kops_max = kops;
+    }
+    if (old_policy >= 0)
+        alloc->set_policy(old_policy);
+    b->kops_mean = sum / trials;
+    double var = trials > 1 ? (sumsq - sum * sum / trials) / (trials - 1) : 0;
+    b->kops_ci = trials > 1 ? t95(trials - 1) * sqrt(var > 0 ? var : 0) / sqrt(trials) : 0;
+}
+
+/*
+ * bench_all - Run every trace on every allocator, print a table and
+ *    write the results to outfile, as JSON if its name ends in .json and
+ *    as CSV otherwise
+ */
+static void bench_all(allocator_t *allocs, int num_allocs, char **tracefiles, int num_tracefiles,
+                      int trials, int warmup, int cpu, const char *outfile) {
+    FILE *out = NULL;
+    bool json = false;
+    int rows = 0;
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) < 0)
+            unix_error("could not pin the harness to its CPU");
+    }
+    if (outfile != NULL) {
+        size_t len = strlen(outfile);
+        json = len >= 5 && !strcmp(outfile + len - 5, ".json");
+        if ((out = fopen(outfile, "w")) == NULL)
+            unix_error("could not create the results file");
+        if (json)
+            fprintf(out, "[\n");
+        else
+            fprintf(out, "allocator,trace,ops,util,kops_mean,kops_ci95,kops_min,kops_max,trials\n");
+    }
+
+    printf("Benchmark results (%d trials after %d warm-up runs, Kops with 95%% CI):\n",
+           trials, warmup);
+    printf("%16s%35s%10s%7s%12s%10s%10s%10s\n", "allocator", "trace", "ops", "util",
+           "Kops", "+-", "min", "max");
+    for (int t = 0; t < num_tracefiles; t++) {
+        trace_t *trace = read_trace(tracedir, tracefiles[t]);
+        for (int i = 0; i < num_allocs; i++) {
+            bench_t b;
+            char util[16] = "-";
+
+            bench_trace(&allocs[i], trace, trials, warmup, &b);
+            if (b.util >= 0)
+                snprintf(util, sizeof(util), "%.0f%%", b.util * 100);
+            printf("%16s%35s%10d%7s%12.0f%10.0f%10.0f%10.0f\n", allocs[i].name, tracefiles[t],
+                   trace->num_ops, util, b.kops_mean, b.kops_ci, b.kops_min, b.kops_max);
+            if (out != NULL) {
+                /* unknown utilization is null in JSON and empty in CSV */
+                char field[16] = "";
+                if (b.util >= 0)
+                    snprintf(field, sizeof(field), "%.4f", b.util);
+                else if (json)
+                    strcpy(field, "null");
+                if (json)
+                    fprintf(out, "%s  {\"allocator\": \"%s\", \"trace\": \"%s\", \"ops\": %d, "
+                                 "\"util\": %s, \"kops_mean\": %.1f, \"kops_ci95\": %.1f, "
+                                 "\"kops_min\": %.1f, \"kops_max\": %.1f, \"trials\": %d}",
+                            rows ? ",\n" : "", allocs[i].name, tracefiles[t], trace->num_ops,
+                            field, b.kops_mean, b.kops_ci, b.kops_min, b.kops_max, trials);
+                else
+                    fprintf(out, "%s,%s,%d,%s,%.1f,%.1f,%.1f,%.1f,%d\n", allocs[i].name,
+                            tracefiles[t], trace->num_ops, field, b.kops_mean, b.kops_ci,
+                            b.kops_min, b.kops_max, trials);
+            }
+            rows++;
+        }
+        free_trace(trace);
+    }
+    if (out != NULL) {
+        if (json)
+            fprintf(out, "\n]\n");
+        fclose(out);
+    }
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -1008,6 +2463,7 @@ static void printresults(int n, stats_t *stats) {
  */
 void app_error(char *msg) {
     printf("%s\n", msg);
+    fflush(stdout); /* before a leak check at exit can cut it off */
     exit(1);
 }
 
@@ -1031,14 +2487,27 @@ void malloc_error(int tracenum, int opnum, char *msg) {
  * usage - Explain the command line arguments
  */
 static void usage(void) {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValpCHsS] [-f <file>] [-t <dir>] [-T <n>] [-P <fit>]\n");
+    fprintf(stderr, "       mdriver -A <alloc> [-A <alloc>...] [-n <trials>] [-w <runs>] [-c <cpu>] [-o <file>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-A <alloc> Benchmark mm, libc or a path to an mm.so, mm[:first|best|good].\n");
+    fprintf(stderr, "\t-c <cpu>   Pin the -A benchmark to this CPU.\n");
+    fprintf(stderr, "\t-C         Count cache and TLB misses per request with perf.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Print latency percentiles of each request type.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-n <n>     Timed trials of each trace for -A (default 5).\n");
+    fprintf(stderr, "\t-o <file>  Write the -A results as CSV, or JSON for a .json name.\n");
+    fprintf(stderr, "\t-p         Split each trace over the threads of -T.\n");
+    fprintf(stderr, "\t-P <fit>   Place with first, best or good fit, or evaluate all.\n");
+    fprintf(stderr, "\t-s         Only stream the -f trace through mm, chunk by chunk.\n");
+    fprintf(stderr, "\t-S         Print mm_stats at each trace's peak.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Also replay each trace on 1..n threads at once.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
+    fprintf(stderr, "\t-w <n>     Untimed warm-up runs of each trace for -A (default 1).\n");
 }
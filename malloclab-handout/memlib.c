@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,28 +11,191 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * Where the heap's memory comes from. With MEM_MMAP the whole of
+ * MAX_HEAP is reserved as address space up front and committed
+ * MEM_COMMIT_SIZE bytes at a time as mem_sbrk grows the heap, so only
+ * what a trace touches costs memory. Otherwise it is one malloc.
+ */
+#ifndef MEM_MMAP
+#define MEM_MMAP 1
+#endif
+#ifndef MEM_HUGEPAGES
+#define MEM_HUGEPAGES 1 /* 0 none, 1 transparent huge pages, 2 MAP_HUGETLB */
+#endif
+#ifndef MEM_KEEP_WARM
+#define MEM_KEEP_WARM 0 /* how mem_keep_warm starts out */
+#endif
+#define MEM_COMMIT_SIZE (1 << 21) /* commit granularity, one huge page */
+#define MEM_HUGE_MIN (1 << 23)    /* heap size from which huge pages pay off */
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_peak_brk;   /* highest mem_brk since the last reset */
+static size_t mem_peak_size; /* largest heap plus mapped bytes since the last reset */
+static char *mem_zero_brk;   /* from here up the heap reads back as zero */
+static pthread_mutex_t mem_lock = PTHREAD_MUTEX_INITIALIZER; /* serializes mem_sbrk */
+static int mem_warm = MEM_KEEP_WARM; /* see mem_keep_warm */
+#if MEM_MMAP
+static char *mem_reserved;   /* the reservation, mem_start_brk rounded down */
+static size_t mem_reserved_size;
+static char *mem_commit_brk; /* end of the committed, read/write part */
+static int mem_huge;         /* huge pages asked for, or not to be tried again */
+#endif
+
+/* Regions handed out by mem_map, outside the heap */
+typedef struct {
+    char *lo;
+    size_t size;
+} mem_region_t;
+
+static mem_region_t *mem_regions;
+static int mem_nregions, mem_regions_cap;
+static size_t mem_mapped;    /* bytes in all of them */
+
+/*
+ * mem_note_peak - raise mem_peak_size to the current footprint
+ */
+static void mem_note_peak(void)
+{
+    size_t size = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+    if (size > mem_peak_size)
+	mem_peak_size = size;
+}
+
+/*
+ * mem_find_region - index of the region starting at lo, or -1
+ */
+static int mem_find_region(void *lo)
+{
+    for (int i = 0; i < mem_nregions; i++)
+	if (mem_regions[i].lo == lo)
+	    return i;
+    return -1;
+}
+
+/*
+ * mem_drop - give the whole pages in [lo, hi) back to the system, they
+ *    read back as zero
+ */
+static void mem_drop(char *lo, char *hi)
+{
+    uintptr_t page = (MEM_MMAP && MEM_HUGEPAGES == 2) ? MEM_COMMIT_SIZE : getpagesize();
+    uintptr_t l = ((uintptr_t)lo + page - 1) & ~(page - 1);
+    uintptr_t h = ((uintptr_t)hi + page - 1) & ~(page - 1);
+
+    if (h > ((uintptr_t)mem_max_addr & ~(page - 1)))
+	h = (uintptr_t)mem_max_addr & ~(page - 1);
+    if (l < h) {
+	madvise((void *)l, h - l, MADV_DONTNEED);
+	if (l < (uintptr_t)mem_zero_brk && h >= (uintptr_t)mem_zero_brk)
+	    mem_zero_brk = (char *)l;
+    }
+}
+
+#if MEM_MMAP
+/*
+ * mem_commit - make the heap readable and writable up to at least end.
+ *    Returns 0, or -1 if the system has no memory left
+ */
+static int mem_commit(char *end)
+{
+    char *new_commit = (char *)(((uintptr_t)end + MEM_COMMIT_SIZE - 1) &
+				~(uintptr_t)(MEM_COMMIT_SIZE - 1));
+    size_t len = new_commit - mem_commit_brk;
+
+    if (end <= mem_commit_brk)
+	return 0;
+#if MEM_HUGEPAGES == 2
+    /* hugetlb pages are reserved here, so running out shows now, not as a SIGBUS */
+    if (!mem_huge && mmap(mem_commit_brk, len, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+			  -1, 0) != MAP_FAILED) {
+	mem_commit_brk = new_commit;
+	return 0;
+    }
+    mem_huge = 1; /* no huge pages to be had, use small ones from now on */
+    /* the failed mmap may have taken the reservation with it, so map over it */
+    if (mmap(mem_commit_brk, len, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED)
+	return -1;
+#else
+    if (mprotect(mem_commit_brk, len, PROT_READ | PROT_WRITE) != 0)
+	return -1;
+#endif
+    mem_commit_brk = new_commit;
+#if MEM_HUGEPAGES == 1
+    if (!mem_huge && new_commit - mem_start_brk >= MEM_HUGE_MIN) {
+	/* the flag sticks to the reservation, chunks committed later get it too */
+	madvise(mem_reserved, mem_reserved_size, MADV_HUGEPAGE);
+	mem_huge = 1;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * mem_decommit - give back the committed part of the heap from lo up
+ *    and make it inaccessible again
+ */
+static void mem_decommit(char *lo)
+{
+    lo = (char *)(((uintptr_t)lo + MEM_COMMIT_SIZE - 1) & ~(uintptr_t)(MEM_COMMIT_SIZE - 1));
+    if (lo >= mem_commit_brk)
+	return;
+#if MEM_HUGEPAGES == 2
+    /* a fresh reservation on top releases hugetlb and small pages alike */
+    mmap(lo, mem_commit_brk - lo, PROT_NONE,
+	 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0);
+#else
+    madvise(lo, mem_commit_brk - lo, MADV_DONTNEED);
+    mprotect(lo, mem_commit_brk - lo, PROT_NONE);
+#endif
+    mem_commit_brk = lo;
+    if (lo < mem_zero_brk)
+	mem_zero_brk = lo;
+}
+#endif
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
+#if MEM_MMAP
+    /* reserve address space only, aligned so huge pages can back it */
+    mem_reserved_size = MAX_HEAP + 2 * (size_t)MEM_COMMIT_SIZE;
+    mem_reserved = mmap(NULL, mem_reserved_size, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_reserved == MAP_FAILED) {
+	fprintf(stderr, "mem_init: mmap error\n");
+	exit(1);
+    }
+    mem_start_brk = (char *)(((uintptr_t)mem_reserved + MEM_COMMIT_SIZE - 1) &
+			     ~(uintptr_t)(MEM_COMMIT_SIZE - 1));
+    mem_commit_brk = mem_start_brk;
+    mem_huge = 0;
+    mem_zero_brk = mem_start_brk; /* fresh anonymous memory */
+#else
     /* allocate the storage we will use to model the available VM */
     if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+	fprintf(stderr, "mem_init: malloc error\n");
 	exit(1);
     }
+    mem_zero_brk = mem_start_brk + MAX_HEAP; /* malloc doesn't promise zeros */
+#endif
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_peak_brk = mem_brk;
+    mem_peak_size = 0;
 }
 
 /* 
@@ -39,35 +203,202 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
+    for (int i = 0; i < mem_nregions; i++)
+	munmap(mem_regions[i].lo, mem_regions[i].size);
+    free(mem_regions);
+    mem_regions = NULL;
+    mem_nregions = mem_regions_cap = 0;
+    mem_mapped = 0;
+#if MEM_MMAP
+    munmap(mem_reserved, mem_reserved_size);
+#else
     free(mem_start_brk);
+#endif
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_keep_warm - Choose what mem_reset_brk gives back: all of the heap
+ *    (on == 0, the default), or only what lies above the high water mark
+ *    of the heap it empties. Then another run of the same trace finds its
+ *    pages already faulted in, and a smaller trace after a large one
+ *    still doesn't keep the large one's pages. Returns the old setting.
+ */
+int mem_keep_warm(int on)
+{
+    pthread_mutex_lock(&mem_lock);
+    int old = mem_warm;
+    mem_warm = on;
+    pthread_mutex_unlock(&mem_lock);
+    return old;
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap,
+ *    giving its memory back as mem_keep_warm says. Regions still mapped
+ *    belong to the old heap and are unmapped.
  */
 void mem_reset_brk()
 {
+    pthread_mutex_lock(&mem_lock);
+    char *keep = mem_warm ? mem_peak_brk : mem_start_brk;
+#if MEM_MMAP
+    mem_decommit(keep);
+#else
+    mem_drop(keep, mem_max_addr);
+#endif
     mem_brk = mem_start_brk;
+    mem_peak_brk = mem_brk;
+    for (int i = 0; i < mem_nregions; i++)
+	munmap(mem_regions[i].lo, mem_regions[i].size);
+    mem_nregions = 0;
+    mem_mapped = 0;
+    mem_peak_size = 0;
+    pthread_mutex_unlock(&mem_lock);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area.
+ *    A negative incr shrinks the heap and hands the whole pages it
+ *    frees back to the system, as sbrk would. Safe to call from
+ *    several threads at once.
  */
 void *mem_sbrk(int incr) 
 {
+    pthread_mutex_lock(&mem_lock);
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (incr < 0 && mem_brk + incr < mem_start_brk) {
+	pthread_mutex_unlock(&mem_lock);
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap...\n");
+	return (void *)-1;
+    }
+    if (((mem_brk + incr) > mem_max_addr)
+#if MEM_MMAP
+	|| mem_commit(mem_brk + incr) != 0
+#endif
+	) {
+	pthread_mutex_unlock(&mem_lock);
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    if (mem_brk > mem_peak_brk)
+	mem_peak_brk = mem_brk;
+    if (mem_brk > mem_zero_brk)
+	mem_zero_brk = mem_brk; /* the caller may write all of it */
+    mem_note_peak();
+    if (incr < 0)
+	mem_drop(mem_brk, old_brk); /* still committed, regrowing is cheap */
+    pthread_mutex_unlock(&mem_lock);
     return (void *)old_brk;
 }
 
+/*
+ * mem_map - model of an anonymous mmap of size bytes (a multiple of the
+ *    page size) outside the heap. Returns the region, or NULL
+ */
+void *mem_map(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+	return NULL;
+    pthread_mutex_lock(&mem_lock);
+    if (mem_nregions == mem_regions_cap) {
+	int cap = mem_regions_cap ? 2 * mem_regions_cap : 64;
+	mem_region_t *r = realloc(mem_regions, cap * sizeof(mem_region_t));
+	if (r == NULL) {
+	    pthread_mutex_unlock(&mem_lock);
+	    munmap(p, size);
+	    return NULL;
+	}
+	mem_regions = r;
+	mem_regions_cap = cap;
+    }
+    mem_regions[mem_nregions].lo = p;
+    mem_regions[mem_nregions++].size = size;
+    mem_mapped += size;
+    mem_note_peak();
+    pthread_mutex_unlock(&mem_lock);
+    return p;
+}
+
+/*
+ * mem_unmap - unmap a region from mem_map. Returns 0, or -1 if p
+ *    doesn't start one
+ */
+int mem_unmap(void *p, size_t size)
+{
+    pthread_mutex_lock(&mem_lock);
+    int i = mem_find_region(p);
+    if (i < 0 || mem_regions[i].size != size) {
+	pthread_mutex_unlock(&mem_lock);
+	errno = EINVAL;
+	return -1;
+    }
+    mem_regions[i] = mem_regions[--mem_nregions];
+    mem_mapped -= size;
+    pthread_mutex_unlock(&mem_lock);
+    munmap(p, size);
+    return 0;
+}
+
+/*
+ * mem_remap - model of mremap: resize a region from mem_map to new_size
+ *    bytes, moving it if need be without copying. Returns the region,
+ *    or NULL leaving the old one as it was
+ */
+void *mem_remap(void *p, size_t old_size, size_t new_size)
+{
+    pthread_mutex_lock(&mem_lock);
+    int i = mem_find_region(p);
+    void *q = (i < 0 || mem_regions[i].size != old_size)
+		  ? MAP_FAILED
+		  : mremap(p, old_size, new_size, MREMAP_MAYMOVE);
+    if (q == MAP_FAILED) {
+	pthread_mutex_unlock(&mem_lock);
+	return NULL;
+    }
+    mem_regions[i].lo = q;
+    mem_regions[i].size = new_size;
+    mem_mapped += new_size - old_size;
+    mem_note_peak();
+    pthread_mutex_unlock(&mem_lock);
+    return q;
+}
+
+/*
+ * mem_is_mapped - is [lo, hi] inside one region from mem_map?
+ */
+int mem_is_mapped(void *lo, void *hi)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&mem_lock);
+    for (int i = 0; i < mem_nregions && !found; i++)
+	found = (char *)lo >= mem_regions[i].lo &&
+		(char *)hi < mem_regions[i].lo + mem_regions[i].size;
+    pthread_mutex_unlock(&mem_lock);
+    return found;
+}
+
+/*
+ * mem_zero_lo - return the lowest address from which the heap, up to
+ *    MAX_HEAP, is known to read as zero: memory mem_sbrk has never
+ *    handed out, or that was given back to the system since. Growing
+ *    the heap past it moves it up to the new brk
+ */
+void *mem_zero_lo()
+{
+    pthread_mutex_lock(&mem_lock);
+    void *lo = mem_zero_brk;
+    pthread_mutex_unlock(&mem_lock);
+    return lo;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +423,16 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peak_heapsize() - returns the largest heap size since the heap
+ *    was last reset, counting the regions mapped at the time. It is
+ *    larger than mem_heapsize once the heap shrinks
+ */
+size_t mem_peak_heapsize()
+{
+    return mem_peak_size;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
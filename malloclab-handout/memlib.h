@@ -5,8 +5,15 @@ void mem_init(void);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
+int mem_keep_warm(int on);
+void *mem_map(size_t size);
+int mem_unmap(void *p, size_t size);
+void *mem_remap(void *p, size_t old_size, size_t new_size);
+int mem_is_mapped(void *lo, void *hi);
+void *mem_zero_lo(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
 
@@ -1,15 +1,20 @@
 /*
- * mm.c -  Simple allocator based on implicit free lists,
- *         first fit placement, and boundary tag coalescing.
+ * mm.c -  Simple allocator based on segregated free lists,
+ *         first, best or good fit placement, and boundary tag coalescing.
  *
- * Each block has header and footer of the form:
+ * Each block has a header of the form:
  *
- *      63       32   31        1   0
- *      --------------------------------
- *     |   unused   | block_size | a/f |
- *      --------------------------------
+ *      63     47 46   41 40   33   32   31        1   0
+ *      -----------------------------------------------------
+ *     | unused | slack | arena | p/f | block_size | a/f |
+ *      -----------------------------------------------------
  *
- * a/f is 1 iff the block is allocated. The list has the following form:
+ * a/f is 1 iff the block is allocated, p/f is 1 iff the block right before
+ * it is allocated. Only free blocks carry a footer (a copy of the header in
+ * their last word); coalesce uses p/f to know when it can read the previous
+ * block's footer. arena and slack are only meaningful in allocated blocks,
+ * see below and mm_stats.
+ * Each chunk of the heap has the following form:
  *
  * begin                                       end
  * heap                                       heap
@@ -21,16 +26,56 @@
  *
  * The allocated prologue and epilogue blocks are overhead that
  * eliminate edge conditions during coalescing.
+ *
+ * Building with -DCOMPACT_LAYOUT=1 shrinks headers and footers to 32 bits
+ * (a/f, p/f and a 30 bit block_size) and stores the free list links as
+ * 32 bit offsets from the start of the heap, which MAX_HEAP keeps in
+ * range. The smallest block is then 16 bytes instead of 32, enough for
+ * payloads of up to 12 bytes, at the price of a 1 GB block size limit.
+ *
+ * Requests of up to SLAB_MAX_SIZE bytes never reach the seg lists. They
+ * are carved out of per size class slab pages: SLAB_PAGE_SIZE aligned
+ * allocated blocks whose payload starts with a slab_t, followed by
+ * header-less objects. slabPageMap marks which pages are slabs, so mm_free
+ * can route a pointer back to its slab without any per-object tag.
+ *
+ * Requests of mmapThreshold bytes and up don't use the heap at all: each
+ * gets a region of its own from mem_map, starting with a mapped_t. Such
+ * payloads lie outside the range memlib grows the heap in, which is how
+ * mm_free and mm_realloc tell them apart.
+ *
+ * Building with -DMM_THREADS=1 makes the mm_ API thread safe. The heap is
+ * then split into NUM_ARENAS arenas, each with its own lock, seg lists and
+ * slabs. An arena owns one or more chunks like the one above; its newest
+ * chunk grows in place while it ends the heap, otherwise the arena starts
+ * a new chunk at the end. A thread starts on the arena of the CPU it runs
+ * on (or round robin) and moves to an idle one when its arena is busy.
+ * Allocated blocks record their arena in the header, so mm_free returns
+ * them to the right one whichever thread frees them. A thread freeing into
+ * an arena other than its own doesn't take that arena's lock: it pushes the
+ * payload onto the arena's lock free remote stack, and whoever locks the
+ * arena next to allocate frees the whole stack in one go.
+ *
+ * In front of the arenas every thread keeps a tcache: bounded, lock free
+ * stacks of recently freed payloads per 8 byte size class, refilled from
+ * and flushed to the arenas in batches.
  */
+#define _GNU_SOURCE /* sched_getcpu */
+#include "config.h"
 #include "memlib.h"
 #include "mm.h"
 #include <assert.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 /* Your info */
 team_t team = {
@@ -42,22 +87,51 @@ team_t team = {
     "meep3",
 };
 
+#ifndef COMPACT_LAYOUT
+#define COMPACT_LAYOUT 0
+#endif
+
+#if COMPACT_LAYOUT
+typedef struct {
+    uint32_t allocated : 1;
+    uint32_t prev_allocated : 1;
+    uint32_t block_size : 30;
+} header_t;
+
+/* free list links are byte offsets from heap_base, 0 meaning NULL */
+typedef uint32_t link_t;
+#else
 typedef struct {
     uint32_t allocated : 1;
     uint32_t block_size : 31;
-    uint32_t _;
+    uint32_t prev_allocated : 1;
+    uint32_t arena : 8; /* owning arena, set while allocated */
+    uint32_t slack : 6; /* usable minus requested bytes, kept with MM_STATS */
+    uint32_t _ : 17;
 } header_t;
 
+typedef struct block_t *link_t;
+#endif
+
 typedef header_t footer_t;
 
 typedef struct block_t{
+#if COMPACT_LAYOUT
+    uint32_t allocated : 1;
+    uint32_t prev_allocated : 1;
+    uint32_t block_size : 30;
+#else
     uint32_t allocated : 1;
     uint32_t block_size : 31;
-    uint32_t _;
+    uint32_t prev_allocated : 1;
+    uint32_t arena : 8; /* owning arena, set while allocated */
+    uint32_t slack : 6; /* usable minus requested bytes, kept with MM_STATS */
+    uint32_t _ : 17;
+#endif
     union {
         struct {
-            struct block_t* next;
-            struct block_t* prev;
+            link_t next;
+            link_t prev;
         };
         int payload[0]; 
     } body;
@@ -68,184 +142,1483 @@ enum block_state { FREE,
                    ALLOC };
 
 #define CHUNKSIZE (1 << 16) /* initial heap size (bytes) */
-#define OVERHEAD (sizeof(header_t) + sizeof(footer_t)) /* overhead of the header and footer of an allocated block */
-#define MIN_BLOCK_SIZE (32) /* the minimum block size needed to keep in a freelist (header + footer + next pointer + prev pointer) */
+#define OVERHEAD (sizeof(header_t)) /* overhead of an allocated block, which has no footer */
+#define MIN_BLOCK_SIZE (2 * (sizeof(header_t) + sizeof(link_t))) /* the minimum block size needed to keep in a freelist (header + footer + next pointer + prev pointer) */
+#if COMPACT_LAYOUT
+#define MAX_BLOCK_SIZE ((1u << 30) - 8) /* largest size the 30 bit block_size field holds */
+#else
+#define MAX_BLOCK_SIZE ((1u << 31) - 8) /* largest size the 31 bit block_size field holds */
+#endif
 #define MAXBITS (16)
 
+/*
+ * Heap trimming. Once the free block at the top of the heap reaches
+ * TRIM_THRESHOLD bytes, all but about TRIM_PAD of it goes back to memlib.
+ * The gap between the two keeps a heap that hovers around one size from
+ * shrinking and growing on every request. Off by default: mdriver frees
+ * everything after each run, and faulting the heap back in every time
+ * costs far more than the runs themselves. Try -DTRIM_THRESHOLD=262144.
+ */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD 0 /* 0 never trims */
+#endif
+#ifndef TRIM_PAD
+#define TRIM_PAD CHUNKSIZE /* free bytes left at the top after a trim */
+#endif
+
+#if TRIM_THRESHOLD && TRIM_THRESHOLD < 2 * TRIM_PAD
+#error "TRIM_THRESHOLD must be at least twice TRIM_PAD, or 0"
+#endif
+
+/*
+ * Huge blocks. Requests of at least mmapThreshold bytes get a region of
+ * their own from mem_map, outside the heap, so freeing one gives all of
+ * it back instead of leaving a hole. As in glibc, the threshold starts
+ * at MMAP_THRESHOLD and rises to the size of any mapped block freed, up
+ * to MMAP_THRESHOLD_MAX, so blocks of a size a program keeps freeing
+ * soon come from the heap again.
+ */
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (128 << 10) /* 128 KB, 0 never maps */
+#endif
+#define MMAP_THRESHOLD_MAX (32 << 20)
+#define MAPPED_TAG 0x6d617070656421ull /* "mapped!", in every mapped_t */
+
+/*
+ * mm_calloc clears blocks of CALLOC_STREAM_MIN bytes and up with non
+ * temporal stores, which don't pull the block into the cache the way
+ * memset would. Memory the heap has just grown into is known to read as
+ * zero and isn't cleared at all.
+ */
+#ifndef CALLOC_STREAM_MIN
+#define CALLOC_STREAM_MIN (256 << 10)
+#endif
+/*
+ * Likewise realloc moves payloads of MOVE_STREAM_MIN bytes and up with
+ * non temporal stores, as wide as the CPU has (AVX-512, AVX2 or SSE2,
+ * picked at run time); smaller ones go through memcpy.
+ */
+#ifndef MOVE_STREAM_MIN
+#define MOVE_STREAM_MIN (256 << 10)
+#endif
+
+/* Starts each mapped region, the payload follows */
+typedef struct {
+    size_t length; /* of the region */
+    uint64_t tag;  /* MAPPED_TAG */
+} mapped_t;
+
+/*
+ * Placement. find_fit picks among the blocks of the request's own size
+ * class by FIT_POLICY, which mm_set_fit_policy can change at run time;
+ * any larger class is served from its head, since all of its blocks fit.
+ * Good fit stops at the FIT_K-th block that fits, or at an exact fit.
+ */
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_FIRST
+#endif
+#ifndef FIT_K
+#define FIT_K 4
+#endif
+#if FIT_POLICY < FIT_FIRST || FIT_POLICY > FIT_GOOD
+#error "FIT_POLICY must be FIT_FIRST, FIT_BEST or FIT_GOOD"
+#endif
+#if FIT_K < 1
+#error "FIT_K must be at least 1"
+#endif
+
+/*
+ * Free list discipline. LIST_LIFO pushes freed blocks onto the head of
+ * their list. LIST_ADDRESS keeps each list in address order, which tends
+ * to fill the low end of the heap and let the top coalesce; LIST_SIZE
+ * keeps it smallest first, so first fit finds the best fit (and the head
+ * of a larger class is its smallest block). The ordered lists pay a walk
+ * on every push, bounded by the length of one size class's list.
+ */
+#define LIST_LIFO 0
+#define LIST_ADDRESS 1
+#define LIST_SIZE 2
+#ifndef LIST_ORDER
+#define LIST_ORDER LIST_LIFO
+#endif
+#if LIST_ORDER < LIST_LIFO || LIST_ORDER > LIST_SIZE
+#error "LIST_ORDER must be LIST_LIFO, LIST_ADDRESS or LIST_SIZE"
+#endif
+
+/*
+ * Cache friendly list walks. With PREFETCH_FIT, find_fit prefetches the
+ * next block of a list while it checks the current one, and block_release
+ * prefetches the free neighbours coalesce is about to unlink. FIT_CACHE
+ * keeps the first FIT_CACHE blocks of every seg list and their sizes in a
+ * side array of the arena, so find_fit checks them without touching the
+ * blocks; the array follows list_push and list_pop and is refilled as
+ * find_fit walks past it. 0 turns it off.
+ */
+#ifndef PREFETCH_FIT
+#define PREFETCH_FIT 0
+#endif
+#ifndef FIT_CACHE
+#define FIT_CACHE 0
+#endif
+#if FIT_CACHE < 0 || FIT_CACHE > 64
+#error "FIT_CACHE must be between 0 and 64"
+#endif
+
+/*
+ * Deferred coalescing. With QUICK_BINS, block_free parks blocks of up to
+ * QUICK_MAX_SIZE bytes in a quick bin of their exact size instead of the
+ * seg lists. They stay marked allocated, so nothing coalesces with them,
+ * and block_alloc hands them out again before calling find_fit. A bin
+ * that reaches QUICK_BIN_COUNT blocks is released to the seg lists in one
+ * go, and so is every bin when find_fit misses, before the heap grows.
+ */
+#ifndef QUICK_BINS
+#define QUICK_BINS 0
+#endif
+#ifndef QUICK_MAX_SIZE
+#define QUICK_MAX_SIZE 512 /* largest block size kept in a quick bin */
+#endif
+#ifndef QUICK_BIN_COUNT
+#define QUICK_BIN_COUNT 32 /* blocks in a quick bin before it is released */
+#endif
+#define QUICK_CLASSES ((QUICK_MAX_SIZE >> 3) + 1)
+
+#if QUICK_MAX_SIZE % 8 || QUICK_BIN_COUNT < 1
+#error "QUICK_MAX_SIZE must be a multiple of 8 and QUICK_BIN_COUNT positive"
+#endif
+
+/*
+ * Size class layout of the seg lists. Blocks smaller than
+ * 2^SMALL_CLASS_LIMIT_BITS bytes get an exact list every
+ * 2^SMALL_CLASS_STEP_BITS bytes. Above that, each power of two is split
+ * into 2^SUB_CLASS_BITS lists (TLSF's second level index). Everything is
+ * derived from these three knobs, so the layout can be tuned per workload
+ * with -D flags without touching segListIndex.
+ */
+#ifndef SMALL_CLASS_STEP_BITS
+#define SMALL_CLASS_STEP_BITS 4 /* exact lists every 16 bytes... */
+#endif
+#ifndef SMALL_CLASS_LIMIT_BITS
+#define SMALL_CLASS_LIMIT_BITS 9 /* ... up to 512 bytes */
+#endif
+#ifndef SUB_CLASS_BITS
+#define SUB_CLASS_BITS 2 /* then 4 lists per power of two */
+#endif
+
+#if SMALL_CLASS_STEP_BITS < 3 || SMALL_CLASS_LIMIT_BITS <= SMALL_CLASS_STEP_BITS
+#error "small size classes must be a multiple of 8 bytes and below the limit"
+#endif
+#if SUB_CLASS_BITS > SMALL_CLASS_LIMIT_BITS - 3
+#error "too many sub classes: the smallest ones would be under 8 bytes wide"
+#endif
+
+#define SMALL_CLASSES (1 << (SMALL_CLASS_LIMIT_BITS - SMALL_CLASS_STEP_BITS))
+#define SUB_CLASSES (1 << SUB_CLASS_BITS)
+/* block sizes fit in 31 bits, so the largest power of two is 2^30 */
+#define LARGE_CLASSES ((31 - SMALL_CLASS_LIMIT_BITS) * SUB_CLASSES)
+#define TOTALNUMLIST (SMALL_CLASSES + LARGE_CLASSES)
+#define BITMAP_WORDS ((TOTALNUMLIST + 63) / 64)
+
+#if BITMAP_WORDS > 64
+#error "too many size classes for a single summary word"
+#endif
+
+/*
+ * Slab layer for tiny requests. Objects are rounded up to a multiple of 8
+ * bytes, giving SLAB_CLASSES classes of 8..SLAB_MAX_SIZE bytes.
+ */
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE 64 /* largest request served from a slab, 0 disables them */
+#endif
+#ifndef SLAB_PAGE_BITS
+#define SLAB_PAGE_BITS 12 /* 4 KB slab pages */
+#endif
+#define SLAB_PAGE_SIZE (1 << SLAB_PAGE_BITS)
+#define SLAB_CLASSES (SLAB_MAX_SIZE >> 3)
+#define SLAB_MAP_BYTES ((MAX_HEAP >> SLAB_PAGE_BITS) / 8 + 2)
+
+#if SLAB_MAX_SIZE % 8 || SLAB_MAX_SIZE * 8 > SLAB_PAGE_SIZE
+#error "SLAB_MAX_SIZE must be a multiple of 8 and fit many times in a page"
+#endif
+
+/* Lives at the start of every slab page, followed by its objects */
+typedef struct slab_t {
+    struct slab_t *next; /* other slabs of this class with free objects */
+    struct slab_t *prev;
+    void *free;          /* freed objects, linked through their first word */
+    char *bump;          /* objects from here up have never been handed out */
+    char *end;           /* end of the last whole object */
+    uint32_t size;       /* object size */
+    uint32_t used;       /* objects currently handed out */
+} slab_t;
+
+#define SLAB_HEADER ((sizeof(slab_t) + 7) & ~7) /* keeps objects 8 byte aligned */
+
+/*
+ * Thread support. Without MM_THREADS the locks compile away and there is
+ * no tcache, so the single threaded allocator pays nothing for it.
+ */
+#ifndef MM_THREADS
+#define MM_THREADS 0
+#endif
+const int mm_thread_safe = MM_THREADS; /* lets the driver know, see mm.h */
+#ifndef TCACHE_MAX_SIZE
+#define TCACHE_MAX_SIZE 1024 /* largest usable size kept in a tcache */
+#endif
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT 32 /* payloads per tcache bin before it is flushed */
+#endif
+#define TCACHE_BATCH (TCACHE_COUNT / 2) /* payloads moved per refill or flush */
+#define TCACHE_BINS ((TCACHE_MAX_SIZE >> 3) + 1)
+
+/*
+ * Arenas. NUM_ARENAS is an upper bound, mm_init uses no more than there
+ * are CPUs online. Compact headers have no room for the arena tag.
+ */
+#ifndef NUM_ARENAS
+#define NUM_ARENAS (MM_THREADS && !COMPACT_LAYOUT ? 8 : 1)
+#endif
+#ifndef ARENA_BY_CPU
+#define ARENA_BY_CPU 1 /* pick a thread's first arena by CPU, 0 for round robin */
+#endif
+
+#if NUM_ARENAS < 1 || NUM_ARENAS > 256
+#error "NUM_ARENAS must be between 1 and 256 to fit the 8 bit arena tag"
+#endif
+#if NUM_ARENAS > 1 && COMPACT_LAYOUT
+#error "compact headers can't hold an arena tag, use NUM_ARENAS=1"
+#endif
+
+/*
+ * Heap checking. mm_checkheap walks heaps of CHECK_PARALLEL_MIN bytes and
+ * up on as many as CHECK_THREADS threads, one slice of the heap each.
+ */
+#ifndef CHECK_THREADS
+#define CHECK_THREADS 8
+#endif
+#ifndef CHECK_PARALLEL_MIN
+#define CHECK_PARALLEL_MIN (4 << 20)
+#endif
+#if CHECK_THREADS < 1
+#error "CHECK_THREADS must be at least 1"
+#endif
+
+/*
+ * Statistics. With MM_STATS every arena counts what its hot paths do and
+ * mm_stats prints the totals, without it the counters compile away.
+ */
+#ifndef MM_STATS
+#define MM_STATS 0
+#endif
+
+#if MM_STATS
+typedef struct {
+    uint64_t fitCalls;                /* find_fit calls */
+    uint64_t fitNodes;                /* list nodes find_fit looked at */
+    uint64_t fitCached;               /* of those, checked in the fit cache */
+    uint64_t fitMisses;               /* find_fit calls that found nothing */
+    uint64_t classHits[TOTALNUMLIST]; /* fits served from each seg list */
+    uint64_t placeSplits;             /* place split the remainder off */
+    uint64_t placeSplinters;          /* place kept a too small remainder */
+    uint64_t coalesceCases[4];        /* coalesce case 1..4 */
+    uint64_t extendCalls;
+    uint64_t extendBytes;             /* bytes extend_heap got from mem_sbrk */
+    uint64_t trimCalls;
+    uint64_t trimBytes;               /* bytes trim_heap gave back */
+    uint64_t quickHits;               /* blocks block_alloc took from a quick bin */
+    uint64_t quickReleases;           /* blocks moved from quick bins to the seg lists */
+    uint64_t callocCalls;
+    uint64_t callocFresh;             /* calloc blocks carved from memory extend_heap just got */
+} counters_t;
+
+#define STAT_INC(a, field) ((a)->stats.field++)
+#define STAT_ADD(a, field, n) ((a)->stats.field += (n))
+#else
+#define STAT_INC(a, field)
+#define STAT_ADD(a, field, n)
+#endif
+
+#if FIT_CACHE
+/* The first count blocks of a seg list, in list order, and their sizes */
+typedef struct {
+    uint32_t count;
+    uint32_t size[FIT_CACHE];
+    block_t *block[FIT_CACHE];
+} __attribute__((aligned(64))) fit_cache_t;
+#endif
+
+/* An independent heap: its own seg lists, slabs and chunks */
+typedef struct arena_t {
+    //Heads of the seg lists
+    block_t *segListHead[TOTALNUMLIST];
+    //Bit i is set iff segListHead[i] is non-empty, so find_fit can skip empty lists
+    uint64_t segListBitmap[BITMAP_WORDS];
+    //Bit w is set iff segListBitmap[w] is non-zero
+    uint64_t segListSummary;
+#if FIT_CACHE
+    fit_cache_t fitCache[TOTALNUMLIST];
+#endif
+    //Slabs of each class that still have free objects, allocation happens from the head
+    slab_t *slabPartial[SLAB_CLASSES + 1];
+    block_t *epilogue; /* epilogue of the newest chunk, NULL until there is one */
+    unsigned id;       /* index in arenas, what allocated blocks are tagged with */
+    char *fresh;       /* set by extend_heap: from here up its memory reads as zero */
+#if QUICK_BINS
+    block_t *quickBin[QUICK_CLASSES];    /* freed blocks of each exact size, linked by next */
+    uint32_t quickCount[QUICK_CLASSES];
+    uint32_t quickBlocks;                /* in all of quickBin */
+#endif
+#if MM_STATS
+    counters_t stats;
+#endif
+#if MM_THREADS
+    pthread_mutex_t lock;
+    void *remote; /* payloads freed by other arenas' threads, see remote_push */
+#endif
+} arena_t;
+
+#if MM_THREADS
+/* Per thread cache of free payloads, bin i holds usable sizes >= 8*i */
+typedef struct {
+    void *head[TCACHE_BINS]; /* linked through the first word of each payload */
+    uint16_t count[TCACHE_BINS];
+    unsigned epoch;          /* heap_epoch the entries belong to */
+    bool registered;         /* tcache_key is set, so exit flushes us */
+} tcache_t;
+
+#define ARENA_LOCK(a) pthread_mutex_lock(&(a)->lock)
+#define ARENA_UNLOCK(a) pthread_mutex_unlock(&(a)->lock)
+/* held while deciding where an arena grows and moving the break */
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+#define GROW_LOCK() pthread_mutex_lock(&grow_lock)
+#define GROW_UNLOCK() pthread_mutex_unlock(&grow_lock)
+#else
+#define ARENA_LOCK(a)
+#define ARENA_UNLOCK(a)
+#define GROW_LOCK()
+#define GROW_UNLOCK()
+#endif
+
 /* Global variables */
-//Pointer to pointer to block_t (Making a continguous "array")
-static block_t **segListHead;
-//Tested and having 11 lists gives good performance as we can stick a lot of the smaller sized blocks in the same list, to reduce fragmentation
-static int TOTALNUMLIST = 11;
-static block_t *prologue; /* pointer to first block */
+static arena_t arenas[NUM_ARENAS];
+static char *heap_base; /* mem_heap_lo(), what compact free list links are relative to */
+//Bit i is set iff the i-th SLAB_PAGE_SIZE page counted from heap_base's page is a slab
+static uint8_t slabPageMap[SLAB_MAP_BYTES];
+static size_t slabPageMapHi; /* bytes of slabPageMap that may be non-zero */
+#if MM_THREADS
+static __thread tcache_t tcache;
+static pthread_key_t tcache_key; /* only used for its destructor */
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static unsigned numArenas = 1; /* arenas in use, at most NUM_ARENAS */
+static __thread int threadArena = -1; /* arena the thread tries first */
+static unsigned nextArena; /* round robin cursor */
+#endif
+static unsigned heap_epoch; /* bumped by mm_init, invalidates every tcache */
+static size_t mmapThreshold = MMAP_THRESHOLD; /* smallest request mapped on its own */
+static int fitPolicy = FIT_POLICY; /* how find_fit picks within a class */
+static block_t *checkCursor; /* where mm_checkheap_step goes on, NULL at the heap start */
 // static block_t *head; /* pointer to start of free list */
  
 /* function prototypes for internal helper routines */
+static int heap_init(void);
+static arena_t *arena_acquire(void);
+static arena_t *payload_arena(void *ptr, size_t size);
 static int segListIndex(int input);
-static block_t *extend_heap(size_t words, bool willCoalesce);
-static void place(block_t *block, size_t asize);
-static block_t *find_fit(size_t asize);
-static block_t *coalesce(block_t *block);
+static uint32_t adjust_size(size_t size);
+static void shrink_block(arena_t *a, block_t *block, size_t asize);
+static block_t *extend_heap(arena_t *a, size_t words, size_t align);
+static void trim_heap(arena_t *a, block_t *block);
+static void *block_alloc(arena_t *a, uint32_t asize);
+static void *block_alloc_aligned(arena_t *a, uint32_t asize, size_t align);
+static size_t aligned_lead(char *payload, size_t align);
+static block_t *find_aligned_fit(arena_t *a, uint32_t asize, size_t align, uint32_t worst);
+static void block_free(arena_t *a, block_t *block);
+static void block_release(arena_t *a, block_t *block);
+#if QUICK_BINS
+static void quick_release(arena_t *a, int bin);
+static bool quick_release_all(arena_t *a);
+#endif
+static bool is_slab(void *ptr);
+static void *slab_alloc(arena_t *a, size_t size);
+static void slab_free(arena_t *a, void *ptr);
+static void *heap_malloc(arena_t *a, size_t size);
+static void *heap_calloc(arena_t *a, size_t size, char **fresh);
+static void clear_payload(void *ptr, size_t size, char *fresh);
+static void move_payload(void *dst, const void *src, size_t n);
+static void heap_free(arena_t *a, void *payload);
+static void *heap_realloc(arena_t *a, void *ptr, size_t size);
+static bool is_mapped(void *ptr);
+static void *map_alloc(size_t size);
+static void map_free(void *ptr);
+static void *map_realloc(void *ptr, size_t size);
+static size_t usable_size(void *ptr);
+#if MM_THREADS
+static void *tcache_get(size_t size);
+static bool tcache_put(void *ptr, size_t size);
+static void remote_push(arena_t *a, void *first, void *last);
+static bool remote_drain(arena_t *a);
+#endif
+static void place(arena_t *a, block_t *block, size_t asize);
+static size_t place_run(arena_t *a, block_t *block, uint32_t asize, size_t n, void **out);
+static size_t block_alloc_batch(arena_t *a, uint32_t asize, size_t n, void **out);
+static block_t *find_fit(arena_t *a, size_t asize);
+static block_t *coalesce(arena_t *a, block_t *block);
 static footer_t *get_footer(block_t *block);
+static void set_footer(block_t *block);
+static block_t *next_block(block_t *block);
 static void printblock(block_t *block);
-static void checkblock(block_t *block);
-static void list_push(block_t *newblock, int index);
-static void list_pop(block_t *removeblock, int index);
+static void list_push(arena_t *a, block_t *newblock, int index);
+static void list_pop(arena_t *a, block_t *removeblock, int index);
+static block_t *list_next(block_t *block);
+static block_t *list_prev(block_t *block);
+static void block_merged(block_t *gone, block_t *into);
+static void note_request(void *ptr, size_t size);
+#if MM_STATS
+static unsigned class_min_size(int index);
+#endif
 
 /*
  * mm_init - Initialize the memory manager
  */
 /* $begin mminit */
+#if MM_THREADS
+static void arena_setup(void) {
+    for (int i = 0; i < NUM_ARENAS; i++)
+        pthread_mutex_init(&arenas[i].lock, NULL);
+}
+#endif
+
 int mm_init(void) {
-    //Put pointers to the different seglists at the beginning of the heap
-    segListHead = mem_sbrk(sizeof(block_t **) * TOTALNUMLIST);
-    //Set all the pointers to NULL to avoid garbages
-    for(int i = 0; i < TOTALNUMLIST; i++){
-        segListHead[i] = NULL;
-    }
-    /* create the initial empty heap */
-    if ((prologue = mem_sbrk(CHUNKSIZE)) == (void*)-1)
+#if MM_THREADS
+    pthread_once(&arena_once, arena_setup);
+#endif
+    for (int i = 0; i < NUM_ARENAS; i++)
+        ARENA_LOCK(&arenas[i]);
+    int ret = heap_init();
+    for (int i = NUM_ARENAS - 1; i >= 0; i--)
+        ARENA_UNLOCK(&arenas[i]);
+    return ret;
+}
+/* $end mminit */
+
+/*
+ * heap_init - Lay out an empty heap, every arena lock held
+ */
+static int heap_init(void) {
+    //Cached payloads from the previous heap are stale now
+    heap_epoch++;
+    heap_base = mem_heap_lo();
+    checkCursor = NULL;
+#if MM_THREADS
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    numArenas = (cpus > 0 && cpus < NUM_ARENAS) ? cpus : NUM_ARENAS;
+#endif
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        arena_t *a = &arenas[i];
+        //Set all the list heads to NULL to avoid garbages
+        memset(a->segListHead, 0, sizeof(a->segListHead));
+        memset(a->segListBitmap, 0, sizeof(a->segListBitmap));
+        a->segListSummary = 0;
+#if FIT_CACHE
+        memset(a->fitCache, 0, sizeof(a->fitCache));
+#endif
+        memset(a->slabPartial, 0, sizeof(a->slabPartial));
+        a->epilogue = NULL;
+        a->id = i;
+#if QUICK_BINS
+        memset(a->quickBin, 0, sizeof(a->quickBin));
+        memset(a->quickCount, 0, sizeof(a->quickCount));
+        a->quickBlocks = 0;
+#endif
+#if MM_STATS
+        memset(&a->stats, 0, sizeof(a->stats));
+#endif
+#if MM_THREADS
+        a->remote = NULL;
+#endif
+    }
+    memset(slabPageMap, 0, slabPageMapHi);
+    slabPageMapHi = 0;
+    /* create the initial empty heap, the other arenas get chunks once used */
+    if (extend_heap(&arenas[0], (CHUNKSIZE - 2 * sizeof(header_t)) >> 3, 0) == NULL)
         return -1;
-    /* initialize the prologue */
-    prologue->allocated = ALLOC;
-    prologue->block_size = sizeof(header_t);
-    /* initialize the first free block */
-    block_t *init_block = (void *)prologue + sizeof(header_t);
-    init_block->allocated = FREE;
-    init_block->block_size = CHUNKSIZE - OVERHEAD;
-    //Setting pointers for explicit free
-    init_block->body.next = NULL;
-    init_block->body.prev = NULL;
-    footer_t *init_footer = get_footer(init_block);
-    init_footer->allocated = FREE;
-    init_footer->block_size = init_block->block_size;
-    /* Put last seglist on first free block */
-    segListHead[TOTALNUMLIST - 1] = init_block;
-    /* initialize the epilogue - block size 0 will be used as a terminating condition */
-    block_t *epilogue = (void *)init_block + init_block->block_size;
-    epilogue->allocated = ALLOC;
-    epilogue->block_size = 0;
     return 0;
 }
-/* $end mminit */
 
 /*
  * mm_malloc - Allocate a block with at least size bytes of payload
  */
 /* $begin mmmalloc */
 void *mm_malloc(size_t size) {
-    uint32_t asize;       /* adjusted block size */
-    uint32_t extendsize;  /* amount to extend heap if no fit */
-    uint32_t extendwords; /* number of words to extend heap if no fit */
-    block_t *block;
+    void *p;
 
-    /* Ignore spurious requests */
-    if (size == 0)
+#if MM_THREADS
+    if ((p = tcache_get(size)) != NULL)
+        return p;
+#endif
+    if (MMAP_THRESHOLD && size >= __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED))
+        return map_alloc(size);
+    arena_t *a = arena_acquire();
+    p = heap_malloc(a, size);
+    ARENA_UNLOCK(a);
+    return p;
+}
+/* $end mmmalloc */
+
+/*
+ * mm_free - Free a block
+ */
+/* $begin mmfree */
+void mm_free(void *payload) {
+    mm_free_sized(payload, 0);
+}
+/* $end mmfree */
+
+/*
+ * mm_free_sized - Free a block whose caller knows its size: the size last
+ *                 asked of mm_malloc or mm_realloc for it, or anything up
+ *                 to mm_usable_size. The tcache then bins it without
+ *                 reading the header, and blocks too big for a slab skip
+ *                 the slab page map. A size of 0 means unknown.
+ */
+void mm_free_sized(void *payload, size_t size) {
+    if (payload == NULL)
+        return;
+    if (is_mapped(payload)) {
+        map_free(payload);
+        return;
+    }
+#if MM_THREADS
+    if (tcache_put(payload, size))
+        return;
+#endif
+    arena_t *a = payload_arena(payload, size);
+#if MM_THREADS
+    if ((int)a->id != threadArena) {
+        remote_push(a, payload, payload);
+        return;
+    }
+#endif
+    ARENA_LOCK(a);
+    if (size > SLAB_MAX_SIZE)
+        block_free(a, payload - sizeof(header_t));
+    else
+        heap_free(a, payload);
+    ARENA_UNLOCK(a);
+}
+
+/*
+ * mm_usable_size - Payload bytes of a live block, at least what was asked
+ *                  for; all of them may be used until it is resized
+ */
+size_t mm_usable_size(void *payload) {
+    if (payload == NULL)
+        return 0;
+    if (is_mapped(payload)) {
+        mapped_t *m = (mapped_t *)payload - 1;
+        return m->length - sizeof(mapped_t);
+    }
+    return usable_size(payload);
+}
+
+/*
+ * mm_memalign - Allocate a block with at least size bytes of payload at an
+ *               address that is a multiple of align, a power of two. The
+ *               slack in front of it becomes a free block of its own, so
+ *               mm_free and mm_realloc take the result like any other.
+ *               Aligned blocks always come from the heap, never a slab.
+ */
+void *mm_memalign(size_t align, size_t size) {
+    uint32_t asize;
+    void *p;
+
+    if (align == 0 || (align & (align - 1)) != 0)
+        return NULL;
+    if (align <= ALIGNMENT)
+        return mm_malloc(size);
+    if (size == 0 || align > MAX_BLOCK_SIZE / 2 || (asize = adjust_size(size)) == 0)
         return NULL;
+    arena_t *a = arena_acquire();
+    p = block_alloc_aligned(a, asize, align);
+    if (p != NULL)
+        note_request(p, size);
+    ARENA_UNLOCK(a);
+    return p;
+}
 
-    /* Adjust block size to include overhead and alignment reqs. */
-    size += OVERHEAD;
+/*
+ * mm_calloc - Allocate n zeroed blocks of size bytes each, NULL if n*size
+ *             overflows. Memory the heap has just grown into is left as
+ *             it is, and large blocks are cleared without filling the
+ *             cache with them.
+ */
+void *mm_calloc(size_t n, size_t size) {
+    char *fresh;
+    void *p;
 
-    asize = ((size + 7) >> 3) << 3; /* align to multiple of 8 */
-    if (asize < MIN_BLOCK_SIZE) {
-        asize = MIN_BLOCK_SIZE;
+    if (__builtin_mul_overflow(n, size, &size))
+        return NULL;
+#if MM_THREADS
+    if ((p = tcache_get(size)) != NULL) {
+        memset(p, 0, size);
+        return p;
     }
+#endif
+    /* a new mapping is zero already */
+    if (MMAP_THRESHOLD && size >= __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED))
+        return map_alloc(size);
+    arena_t *a = arena_acquire();
+    p = heap_calloc(a, size, &fresh);
+    ARENA_UNLOCK(a);
+    if (p != NULL)
+        clear_payload(p, size, fresh);
+    return p;
+}
 
-    //Optimization that improves performance by automatically extending heap for small malloc() calls
-    if (asize <= 96){
-        extendsize = asize;
-        extendwords = extendsize >> 3;
-       block = extend_heap(extendwords, false );
-        if(block != NULL){
+/*
+ * mm_malloc_batch - Allocate n blocks of size bytes each into out[],
+ *                   returning how many, fewer than n only when memory
+ *                   runs out. Blocks of the seg lists are carved side by
+ *                   side out of as few free blocks as possible.
+ */
+size_t mm_malloc_batch(size_t size, size_t n, void **out) {
+    size_t got = 0;
+    uint32_t asize;
 
-            place(block,asize);
-            return block->body.payload;
+    if (size == 0 || n == 0)
+        return 0;
+    if (MMAP_THRESHOLD && size >= __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED)) {
+        while (got < n && (out[got] = map_alloc(size)) != NULL)
+            got++;
+        return got;
+    }
+    arena_t *a = arena_acquire();
+    if (size <= SLAB_MAX_SIZE)
+        while (got < n && (out[got] = slab_alloc(a, size)) != NULL)
+            got++;
+    if (got < n && (asize = adjust_size(size)) != 0) {
+        size_t placed = block_alloc_batch(a, asize, n - got, out + got);
+        for (size_t i = got; i < got + placed; i++)
+            note_request(out[i], size);
+        got += placed;
+    }
+    ARENA_UNLOCK(a);
+    return got;
+}
+
+static int payload_cmp(const void *x, const void *y) {
+    uintptr_t p = (uintptr_t)*(void *const *)x, q = (uintptr_t)*(void *const *)y;
+    return (p > q) - (p < q);
+}
+
+/* Switch from holding held's lock, if any, to holding the lock of the arena of payload */
+static arena_t *batch_lock(arena_t *held, void *payload) {
+    arena_t *owner = payload_arena(payload, 0);
+    if (owner != held) {
+        if (held != NULL)
+            ARENA_UNLOCK(held);
+        ARENA_LOCK(owner);
+    }
+    return owner;
+}
+
+/*
+ * mm_free_batch - Free the n payloads of ptrs[], which it reorders.
+ *                 Slab objects and mapped blocks go first. The rest are
+ *                 freed in address order, and each run of them lying back
+ *                 to back goes back to the seg lists as a single free
+ *                 block, so it is coalesced once instead of once per block.
+ */
+void mm_free_batch(void **ptrs, size_t n) {
+    arena_t *a = NULL; /* arena whose lock is held */
+    size_t i, m = 0;
+
+    for (i = 0; i < n; i++) {
+        void *payload = ptrs[i];
+        if (payload == NULL)
+            continue;
+        if (is_mapped(payload)) {
+            map_free(payload);
+        } else if (is_slab(payload)) {
+            a = batch_lock(a, payload);
+            slab_free(a, payload);
+        } else {
+            ptrs[m++] = payload;
+        }
+    }
+    qsort(ptrs, m, sizeof(void *), payload_cmp);
+    for (i = 0; i < m; i++) {
+        a = batch_lock(a, ptrs[i]);
+        block_t *block = ptrs[i] - sizeof(header_t);
+        size_t run = block->block_size;
+        /* a neighbour in ptrs[] is an allocated block of the same chunk */
+        while (i + 1 < m && ptrs[i + 1] == (void *)block + run + sizeof(header_t) &&
+               run + ((block_t *)((void *)block + run))->block_size <= MAX_BLOCK_SIZE) {
+            block_merged((void *)block + run, block);
+            run += ((block_t *)((void *)block + run))->block_size;
+            i++;
+        }
+        if (run == block->block_size) {
+            block_free(a, block);
+        } else {
+            block->block_size = run;
+            block_release(a, block);
         }
     }
+    if (a != NULL)
+        ARENA_UNLOCK(a);
+}
 
-    /* Search the free list for a fit */
-    if ((block = find_fit(asize)) != NULL) {
-        place(block, asize);
-        return block->body.payload;
+/*
+ * mm_realloc - Resize a block, in place whenever the heap allows it
+ */
+void *mm_realloc(void *ptr, size_t size) {
+    void *newp;
+
+    if (ptr == NULL)
+        return mm_malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
     }
+    if (is_mapped(ptr))
+        return map_realloc(ptr, size);
+    arena_t *a = payload_arena(ptr, 0);
+    ARENA_LOCK(a);
+    newp = heap_realloc(a, ptr, size);
+    ARENA_UNLOCK(a);
+    return newp;
+}
 
-    /* No fit found. Get more memory and place the block */
-    extendsize = (asize > CHUNKSIZE) // extend by the larger of the two
-                     ? asize
-                     : CHUNKSIZE;
-    extendwords = extendsize >> 3; // extendsize/8
-    if ((block = extend_heap(extendwords, true)) != NULL) {
-        place(block, asize);
-        return block->body.payload;
+/*
+ * is_mapped - Is ptr the payload of a mapped block? Anything outside the
+ *             MAX_HEAP bytes memlib can grow the heap to must be one
+ */
+static bool is_mapped(void *ptr) {
+    return MMAP_THRESHOLD && (uintptr_t)((char *)ptr - heap_base) >= MAX_HEAP;
+}
+
+/*
+ * map_alloc - Give a request a region of its own
+ */
+static void *map_alloc(size_t size) {
+    size_t page = mem_pagesize();
+    mapped_t *m;
+
+    if (size > SIZE_MAX - sizeof(mapped_t) - page)
+        return NULL;
+    size_t length = (size + sizeof(mapped_t) + page - 1) & ~(page - 1);
+    if ((m = mem_map(length)) == NULL)
+        return NULL;
+    m->length = length;
+    m->tag = MAPPED_TAG;
+    return m + 1;
+}
+
+/*
+ * map_free - Unmap a mapped block and raise the threshold to its size
+ */
+static void map_free(void *ptr) {
+    mapped_t *m = (mapped_t *)ptr - 1;
+
+    assert(m->tag == MAPPED_TAG);
+    if (m->length > __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED) &&
+        m->length <= MMAP_THRESHOLD_MAX)
+        __atomic_store_n(&mmapThreshold, m->length, __ATOMIC_RELAXED);
+    mem_unmap(m, m->length);
+}
+
+/*
+ * map_realloc - mm_realloc of a mapped block to a non-zero size
+ *
+ * The region is resized with mem_remap, which moves pages rather than
+ * bytes. Only a block shrinking below the threshold is copied into the
+ * heap. Heap blocks growing past the threshold stay in the heap, where
+ * heap_realloc can often grow them in place.
+ */
+static void *map_realloc(void *ptr, size_t size) {
+    mapped_t *m = (mapped_t *)ptr - 1;
+    size_t page = mem_pagesize();
+    void *newp;
+
+    assert(m->tag == MAPPED_TAG);
+    if (size < __atomic_load_n(&mmapThreshold, __ATOMIC_RELAXED)) {
+        if ((newp = mm_malloc(size)) == NULL)
+            return NULL;
+        move_payload(newp, ptr, size);
+        map_free(ptr);
+        return newp;
     }
-    /* no more memory :( */
-    return NULL;
+    if (size > SIZE_MAX - sizeof(mapped_t) - page)
+        return NULL;
+    size_t length = (size + sizeof(mapped_t) + page - 1) & ~(page - 1);
+    if (length != m->length) {
+        if ((m = mem_remap(m, m->length, length)) == NULL)
+            return NULL;
+        m->length = length;
+    }
+    return m + 1;
 }
-/* $end mmmalloc */
 
 /*
- * mm_free - Free a block
+ * heap_calloc - heap_malloc for mm_calloc, also setting *fresh to where
+ *               the zero memory extend_heap got for the block starts, or
+ *               NULL if the heap didn't grow
  */
-/* $begin mmfree */
-void mm_free(void *payload) {
-    //pointer to front of allocated block
-    block_t *block = payload - sizeof(header_t);
-    block->allocated = FREE;
-    footer_t *footer = get_footer(block);
-    footer->allocated = FREE;
-    int freeIndex = segListIndex(block->block_size);
-    list_push(block, freeIndex);
-    coalesce(block);
+static void *heap_calloc(arena_t *a, size_t size, char **fresh) {
+    void *p;
 
+    a->fresh = NULL;
+    p = heap_malloc(a, size);
+    /* a slab page may be new, but its objects have been linked up */
+    *fresh = (p == NULL || is_slab(p)) ? NULL : a->fresh;
+    STAT_INC(a, callocCalls);
+    if (*fresh != NULL)
+        STAT_INC(a, callocFresh);
+    return p;
 }
 
-/* $end mmfree */
+/*
+ * clear_bytes - Zero n bytes at p, with non temporal stores if there are
+ *               so many that they would only push everything else out of
+ *               the cache
+ */
+static void clear_bytes(char *p, size_t n) {
+#ifdef __SSE2__
+    if (n >= CALLOC_STREAM_MIN) {
+        char *body = (char *)(((uintptr_t)p + 15) & ~(uintptr_t)15);
+        char *end = (char *)((uintptr_t)(p + n) & ~(uintptr_t)15);
+        __m128i zero = _mm_setzero_si128();
+        memset(p, 0, body - p);
+        for (char *q = body; q < end; q += 16)
+            _mm_stream_si128((__m128i *)q, zero);
+        memset(end, 0, p + n - end);
+        _mm_sfence();
+        return;
+    }
+#endif
+    memset(p, 0, n);
+}
 
+#ifdef __SSE2__
 /*
- * mm_realloc - naive implementation of mm_realloc
- * NO NEED TO CHANGE THIS CODE!
+ * copy_stream_* - Copy n bytes from src to dst with non temporal stores,
+ *                 dst 64 byte aligned and n a multiple of 64
  */
-void *mm_realloc(void *ptr, size_t size) {
+__attribute__((target("avx512f"))) static void copy_stream_avx512(char *dst, const char *src, size_t n) {
+    for (size_t i = 0; i < n; i += 64)
+        _mm512_stream_si512((void *)(dst + i), _mm512_loadu_si512(src + i));
+}
+
+__attribute__((target("avx2"))) static void copy_stream_avx2(char *dst, const char *src, size_t n) {
+    for (size_t i = 0; i < n; i += 64) {
+        __m256i lo = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i hi = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        _mm256_stream_si256((__m256i *)(dst + i), lo);
+        _mm256_stream_si256((__m256i *)(dst + i + 32), hi);
+    }
+}
+
+static void copy_stream_sse2(char *dst, const char *src, size_t n) {
+    for (size_t i = 0; i < n; i += 64)
+        for (size_t j = i; j < i + 64; j += 16)
+            _mm_stream_si128((__m128i *)(dst + j), _mm_loadu_si128((const __m128i *)(src + j)));
+}
+
+typedef void (*copy_stream_t)(char *dst, const char *src, size_t n);
+static copy_stream_t copyStream; /* the widest of the above the CPU runs, set on first use */
+#endif
+
+/*
+ * move_payload - Copy n bytes of payload to a block that doesn't overlap
+ *                src, keeping large copies out of the cache
+ */
+static void move_payload(void *dst, const void *src, size_t n) {
+#ifdef __SSE2__
+    if (n >= MOVE_STREAM_MIN) {
+        copy_stream_t copy = __atomic_load_n(&copyStream, __ATOMIC_RELAXED);
+        if (copy == NULL) {
+            __builtin_cpu_init();
+            copy = __builtin_cpu_supports("avx512f") ? copy_stream_avx512
+                   : __builtin_cpu_supports("avx2")  ? copy_stream_avx2
+                                                     : copy_stream_sse2;
+            __atomic_store_n(&copyStream, copy, __ATOMIC_RELAXED);
+        }
+        char *d = dst;
+        const char *s = src;
+        size_t head = -(uintptr_t)d & 63;
+        size_t body = (n - head) & ~(size_t)63;
+        memcpy(d, s, head);
+        copy(d + head, s + head, body);
+        memcpy(d + head + body, s + head + body, n - head - body);
+        _mm_sfence();
+        return;
+    }
+#endif
+    memcpy(dst, src, n);
+}
+
+/*
+ * clear_payload - Zero the first size bytes of block ptr. Below fresh the
+ *                 block's memory has been used before, or holds the free
+ *                 list links extend_heap gave it; above it only the footer
+ *                 the block had while it was free has been written since
+ *                 the heap grew.
+ */
+static void clear_payload(void *ptr, size_t size, char *fresh) {
+    char *p = ptr, *end = p + size;
+
+    if (fresh == NULL || fresh >= end) {
+        clear_bytes(p, size);
+        return;
+    }
+    if (fresh > p)
+        clear_bytes(p, fresh - p);
+    char *lo = fresh > p ? fresh : p;
+    char *footer = p + usable_size(ptr) - sizeof(footer_t);
+    if (footer >= lo && footer < end)
+        memset(footer, 0, end - footer);
+}
+
+/*
+ * heap_malloc - mm_malloc on arena a, its lock held
+ */
+static void *heap_malloc(arena_t *a, size_t size) {
+    uint32_t asize;       /* adjusted block size */
+
+    /* Ignore spurious requests */
+    if (size == 0)
+        return NULL;
+
+    /* Tiny requests are served from slab pages */
+    if (size <= SLAB_MAX_SIZE) {
+        void *obj = slab_alloc(a, size);
+        if (obj != NULL)
+            return obj;
+    }
+
+    /* Adjust block size to include overhead and alignment reqs. */
+    if ((asize = adjust_size(size)) == 0)
+        return NULL;
+
+    void *p = block_alloc(a, asize);
+    if (p != NULL)
+        note_request(p, size);
+    return p;
+}
+
+/*
+ * heap_free - mm_free of a payload owned by arena a, its lock held
+ */
+static void heap_free(arena_t *a, void *payload) {
+    if (is_slab(payload)) {
+        slab_free(a, payload);
+        return;
+    }
+    //pointer to front of allocated block
+    block_free(a, payload - sizeof(header_t));
+}
+
+/*
+ * heap_realloc - mm_realloc of a live block owned by arena a to a non-zero
+ *                size, a's lock held
+ *
+ * Shrinking splits the tail off and hands it back to the seg lists.
+ * Growing absorbs a free successor, or extends the heap when the block
+ * is the last one before the arena's epilogue. Only when neither works is
+ * the payload copied into a fresh block of the same arena.
+ */
+static void *heap_realloc(arena_t *a, void *ptr, size_t size) {
     void *newp;
     size_t copySize;
+    uint32_t asize;
 
-    if ((newp = mm_malloc(size)) == NULL) {
-        printf("ERROR: mm_malloc failed in mm_realloc\n");
-        exit(1);
+    /* Slab objects can't grow, so keep them only while the request fits */
+    if (is_slab(ptr)) {
+        slab_t *slab = (void *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+        if (size <= slab->size)
+            return ptr;
+        if ((newp = heap_malloc(a, size)) == NULL)
+            return NULL;
+        memcpy(newp, ptr, slab->size);
+        slab_free(a, ptr);
+        return newp;
     }
-    block_t* block = ptr - sizeof(header_t);
-    copySize = block->block_size;
+    if ((asize = adjust_size(size)) == 0)
+        return NULL;
+
+    block_t *block = ptr - sizeof(header_t);
+
+    /* Shrinking (or same size): split the tail off in place */
+    if (asize <= block->block_size) {
+        shrink_block(a, block, asize);
+        note_request(ptr, size);
+        return ptr;
+    }
+
+    /* Growing: absorb the next block if it is free and big enough */
+    block_t *next = next_block(block);
+    if (!next->allocated && block->block_size + next->block_size >= asize &&
+        block->block_size + next->block_size <= MAX_BLOCK_SIZE) {
+        list_pop(a, next, segListIndex(next->block_size));
+        block_merged(next, block);
+        block->block_size += next->block_size;
+        next_block(block)->prev_allocated = ALLOC;
+        shrink_block(a, block, asize);
+        note_request(ptr, size);
+        return ptr;
+    }
+
+    /* Growing at the end of the arena: extend it just enough to fit */
+    block_t *after = next->allocated ? next : next_block(next);
+    if (after == a->epilogue && asize + MIN_BLOCK_SIZE <= MAX_BLOCK_SIZE) {
+        uint32_t avail = block->block_size + (next->allocated ? 0 : next->block_size);
+        uint32_t extendsize = asize - avail;
+        /* the new area has to be able to stand as a free block first */
+        if (extendsize < MIN_BLOCK_SIZE)
+            extendsize = MIN_BLOCK_SIZE;
+        block_t *tail = extend_heap(a, extendsize >> 3, 0);
+        /* another arena may have grown meanwhile, then tail is a new chunk */
+        if (tail == next_block(block)) {
+            /* extend_heap coalesced the free successor (if any) into tail */
+            list_pop(a, tail, segListIndex(tail->block_size));
+            block_merged(tail, block);
+            block->block_size += tail->block_size;
+            next_block(block)->prev_allocated = ALLOC;
+            shrink_block(a, block, asize);
+            note_request(ptr, size);
+            return ptr;
+        }
+    }
+
+    /* No room around the block: move the payload somewhere else */
+    if ((newp = heap_malloc(a, size)) == NULL)
+        return NULL;
+    copySize = block->block_size - OVERHEAD;
     if (size < copySize)
         copySize = size;
-    memcpy(newp, ptr, copySize);
-    mm_free(ptr);
+    move_payload(newp, ptr, copySize);
+    block_free(a, block);
     return newp;
 }
 
 /*
- * mm_checkheap - Check the heap for consistency
+ * check_block - Check one block of a heap walk; prev_alloc is whether the
+ *               walk found the block before it allocated, -1 if it
+ *               started here. Counts free blocks in *free_blocks and
+ *               returns the number of errors found.
  */
-void mm_checkheap(int verbose) {
-    block_t *block = prologue;
+static unsigned check_block(block_t *block, int prev_alloc, char *heap_end, size_t *free_blocks) {
+    unsigned errors = 0;
 
-    if (verbose)
-        printf("Heap (%p):\n", prologue);
+#define CHECK_ERROR(...) (printf(__VA_ARGS__), errors++)
+    if ((uint64_t)block->body.payload % 8)
+        CHECK_ERROR("Error: payload for block at %p is not aligned\n", block);
+    if (block->block_size < MIN_BLOCK_SIZE || (char *)block + block->block_size >= heap_end) {
+        CHECK_ERROR("Error: block %p has a bogus size %u\n", block, (unsigned)block->block_size);
+        return errors;
+    }
+    if (prev_alloc >= 0 && block->prev_allocated != (unsigned)prev_alloc)
+        CHECK_ERROR("Error: prev_allocated bit of %p is stale\n", block);
+    /* allocated blocks have no footer or links to check */
+    if (block->allocated)
+        return errors;
+    (*free_blocks)++;
+    footer_t *footer = get_footer(block);
+    if (block->block_size != footer->block_size || footer->allocated)
+        CHECK_ERROR("Error: header does not match footer\n");
+    if (!block->prev_allocated) {
+        uint32_t prev_size = ((footer_t *)block - 1)->block_size;
+        /* coalesce only leaves neighbours apart when they'd be too big together */
+        if ((size_t)prev_size + block->block_size <= MAX_BLOCK_SIZE)
+            CHECK_ERROR("Error: free blocks %p and %p aren't coalesced\n",
+                        (char *)block - prev_size, block);
+    }
+
+    /* the block must be linked into the seg list segListIndex picks */
+    int index = segListIndex(block->block_size);
+    block_t *prev = list_prev(block), *next = list_next(block);
+    bool linked = false;
+    if (prev == NULL) {
+        for (int i = 0; i < NUM_ARENAS; i++)
+            linked |= arenas[i].segListHead[index] == block;
+    } else if ((char *)prev >= heap_base && (char *)prev < heap_end) {
+        linked = list_next(prev) == block;
+    }
+    if (next != NULL && ((char *)next < heap_base || (char *)next >= heap_end || list_prev(next) != block))
+        linked = false;
+    if (!linked)
+        CHECK_ERROR("Error: free block %p isn't linked into seg list %d\n", block, index);
+#undef CHECK_ERROR
+    return errors;
+}
 
-    if (block->block_size != sizeof(header_t) || !block->allocated)
-        printf("Bad prologue header\n");
-    checkblock(prologue);
+/* One stretch of the heap for a checker thread, see check_range */
+typedef struct {
+    block_t *from; /* first block, or the prologue of a chunk */
+    block_t *to;   /* block the next range starts at, NULL for the heap end */
+    size_t limit;  /* blocks to check at most */
+    block_t *stop; /* where the walk stopped, NULL at the heap end */
+    size_t freeBlocks;
+    unsigned errors;
+    bool verbose;
+} check_range_t;
+
+/*
+ * check_range - Walk the heap from r->from to r->to, or for r->limit
+ *               blocks, checking each block and each chunk's prologue
+ *               and epilogue. The walk must land on r->to exactly.
+ */
+static void *check_range(void *arg) {
+    check_range_t *r = arg;
+    char *heap_end = (char *)mem_heap_hi() + 1;
+    block_t *block = r->from;
+    int prev_alloc = -1;
+    int arena = -1; /* all allocated blocks of a chunk belong to one arena */
 
-    /* iterate through the heap (both free and allocated blocks will be present) */
-    for (block = (void*)prologue+prologue->block_size; block->block_size > 0; block = (void *)block + block->block_size) {
-        if (verbose)
+    for (size_t n = 0; block != r->to && n < r->limit; n++) {
+        if ((char *)block >= heap_end || (r->to != NULL && block > r->to)) {
+            if (r->to != NULL) {
+                printf("Error: heap walk from %p skipped block %p\n", r->from, r->to);
+                r->errors++;
+            }
+            block = NULL;
+            break;
+        }
+        if (r->verbose)
             printblock(block);
-        checkblock(block);
+        if (block->block_size == sizeof(header_t)) { /* the prologue of a chunk */
+            if (!block->allocated) {
+                printf("Bad prologue header at %p\n", block);
+                r->errors++;
+            }
+            prev_alloc = true;
+            arena = -1;
+        } else if (block->block_size == 0) { /* its epilogue */
+            if (!block->allocated) {
+                printf("Bad epilogue header\n");
+                r->errors++;
+            }
+            if (prev_alloc >= 0 && block->prev_allocated != (unsigned)prev_alloc) {
+                printf("Error: prev_allocated bit of the epilogue is stale\n");
+                r->errors++;
+            }
+            /* the chunks of all arenas lie back to back */
+            block = (void *)block + sizeof(header_t);
+            prev_alloc = -1;
+            continue;
+        } else {
+            uint32_t errors = check_block(block, prev_alloc, heap_end, &r->freeBlocks);
+            r->errors += errors;
+            if (errors != 0 && block->block_size < MIN_BLOCK_SIZE)
+                break; /* no telling where the next block is */
+            prev_alloc = block->allocated;
+#if NUM_ARENAS > 1
+            if (block->allocated && arena >= 0 && block->arena != arena) {
+                printf("Error: block %p is tagged with arena %d, its chunk with %d\n",
+                       block, block->arena, arena);
+                r->errors++;
+            }
+            if (block->allocated)
+                arena = block->arena;
+#endif
+        }
+        block = (void *)block + block->block_size;
     }
+    (void)arena;
+    if (block != NULL && block == r->to && prev_alloc >= 0 && block->prev_allocated != (unsigned)prev_alloc) {
+        printf("Error: prev_allocated bit of %p is stale\n", block);
+        r->errors++;
+    }
+    r->stop = (block != NULL && (char *)block < heap_end) ? block : NULL;
+    return NULL;
+}
 
+/*
+ * check_lists - Check that every seg list block is free, of its list's
+ *               class and linked both ways, with its FIT_CACHE entry
+ *               right; counts them into *listed. With ranges > 1, the
+ *               lowest listed block of each of that many equal slices of
+ *               the heap is put into anchor[] for the walks to start at.
+ */
+static unsigned check_lists(size_t *listed, block_t **anchor, int ranges) {
+    char *heap_end = (char *)mem_heap_hi() + 1;
+    size_t span = (heap_end - heap_base) / ranges + 1;
+    size_t most = (heap_end - heap_base) / MIN_BLOCK_SIZE; /* more blocks means a cycle */
+    unsigned errors = 0;
+
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        for (int index = 0; index < TOTALNUMLIST; index++) {
+            uint32_t n = 0;
+            block_t *prev = NULL;
+            for (block_t *block = arenas[i].segListHead[index]; block != NULL;
+                 prev = block, block = list_next(block), n++) {
+                if ((char *)block < heap_base || (char *)block >= heap_end || n > most) {
+                    printf("Error: seg list %d runs out of the heap at %p\n", index, block);
+                    errors++;
+                    break;
+                }
+                if (block->allocated || segListIndex(block->block_size) != index ||
+                    list_prev(block) != prev) {
+                    printf("Error: block %p doesn't belong in seg list %d\n", block, index);
+                    errors++;
+                    continue;
+                }
+#if FIT_CACHE
+                fit_cache_t *c = &arenas[i].fitCache[index];
+                if (n < c->count && (c->block[n] != block || c->size[n] != block->block_size)) {
+                    printf("Error: fit cache of seg list %d is stale at %p\n", index, block);
+                    errors++;
+                }
+#endif
+                size_t slice = ((char *)block - heap_base) / span;
+                if (slice > 0 && (anchor[slice] == NULL || block < anchor[slice]) &&
+                    (char *)block + block->block_size < heap_end &&
+                    get_footer(block)->block_size == block->block_size)
+                    anchor[slice] = block;
+            }
+            *listed += n;
+#if FIT_CACHE
+            if (n < arenas[i].fitCache[index].count) {
+                printf("Error: fit cache of seg list %d holds more blocks than the list\n", index);
+                errors++;
+            }
+#endif
+        }
+    }
+#if QUICK_BINS
+    /* quick bins only hold allocated blocks of their own size */
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        uint32_t count = 0;
+        for (int bin = 0; bin < QUICK_CLASSES; bin++)
+            for (block_t *block = arenas[i].quickBin[bin]; block != NULL; block = list_next(block), count++) {
+                if ((char *)block < heap_base || (char *)block >= heap_end || count > most) {
+                    printf("Error: quick bin %d runs out of the heap at %p\n", bin, block);
+                    errors++;
+                    break;
+                }
+                if (!block->allocated || block->block_size != (uint32_t)bin << 3) {
+                    printf("Error: block %p doesn't belong in quick bin %d\n", block, bin);
+                    errors++;
+                }
+            }
+        if (count != arenas[i].quickBlocks) {
+            printf("Error: arena %d counts %u quick bin blocks, its bins hold %u\n",
+                   i, arenas[i].quickBlocks, count);
+            errors++;
+        }
+    }
+#endif
+    return errors;
+}
+
+/*
+ * mm_checkheap - Check the heap for consistency, with verbose printing
+ *                every block. A heap of CHECK_PARALLEL_MIN bytes or more
+ *                is walked in up to CHECK_THREADS slices at once, each
+ *                starting at a seg list block; a walk that doesn't land
+ *                on the next slice's first block is an error too.
+ *                Returns the number of errors found.
+ */
+unsigned mm_checkheap(int verbose) {
+    check_range_t range[CHECK_THREADS];
+    block_t *anchor[CHECK_THREADS] = {NULL};
+    pthread_t thread[CHECK_THREADS];
+    bool started[CHECK_THREADS] = {false};
+    size_t listed = 0, found = 0;
+    unsigned errors;
+    int ranges = 1;
+
+    for (int i = 0; i < NUM_ARENAS; i++)
+        ARENA_LOCK(&arenas[i]);
     if (verbose)
-        printblock(block);
-    if (block->block_size != 0 || !block->allocated)
-        printf("Bad epilogue header\n");
+        printf("Heap (%p):\n", heap_base);
+    if (!verbose && mem_heapsize() >= CHECK_PARALLEL_MIN) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus > 1)
+            ranges = cpus < CHECK_THREADS ? cpus : CHECK_THREADS;
+    }
+    errors = check_lists(&listed, anchor, ranges);
+
+    /* slices without a listed block are walked by the one before */
+    anchor[0] = (block_t *)heap_base;
+    int n = 0;
+    for (int s = 0; s < ranges; s++) {
+        if (anchor[s] == NULL)
+            continue;
+        range[n] = (check_range_t){.from = anchor[s], .limit = SIZE_MAX, .verbose = verbose};
+        if (n > 0)
+            range[n - 1].to = anchor[s];
+        n++;
+    }
+    for (int t = 1; t < n; t++)
+        started[t] = pthread_create(&thread[t], NULL, check_range, &range[t]) == 0;
+    for (int t = 0; t < n; t++) {
+        if (started[t])
+            pthread_join(thread[t], NULL);
+        else
+            check_range(&range[t]);
+        errors += range[t].errors;
+        found += range[t].freeBlocks;
+    }
+    if (found != listed) {
+        printf("Error: the heap has %zu free blocks, the seg lists %zu\n", found, listed);
+        errors++;
+    }
+    if (verbose)
+        printf("%u errors\n", errors);
+    for (int i = NUM_ARENAS - 1; i >= 0; i--)
+        ARENA_UNLOCK(&arenas[i]);
+    return errors;
+}
+
+/*
+ * mm_checkheap_step - Check up to blocks blocks of the heap, going on
+ *                     from where the last call stopped and starting over
+ *                     at the end. Free blocks are checked against their
+ *                     seg list neighbours, not counted against the lists.
+ *                     Returns the number of errors found.
+ */
+unsigned mm_checkheap_step(size_t blocks) {
+    check_range_t r = {.limit = blocks};
+
+    for (int i = 0; i < NUM_ARENAS; i++)
+        ARENA_LOCK(&arenas[i]);
+    if (heap_base != NULL && mem_heapsize() > 0) {
+        r.from = checkCursor != NULL ? checkCursor : (block_t *)heap_base;
+        check_range(&r);
+        checkCursor = r.stop;
+    }
+    for (int i = NUM_ARENAS - 1; i >= 0; i--)
+        ARENA_UNLOCK(&arenas[i]);
+    return r.errors;
+}
+
+/*
+ * mm_set_fit_policy - Choose how find_fit picks among the free blocks
+ *                     of a size class, FIT_FIRST, FIT_BEST or FIT_GOOD.
+ *                     Returns the policy it replaces, -1 for anything else.
+ */
+int mm_set_fit_policy(int policy) {
+    if (policy < FIT_FIRST || policy > FIT_GOOD)
+        return -1;
+    return __atomic_exchange_n(&fitPolicy, policy, __ATOMIC_RELAXED);
+}
+
+/*
+ * mm_stats - Print what the allocator did since mm_init, and how
+ *            fragmented the heap is right now
+ *
+ * Internal fragmentation is the share of allocated memory (blocks and
+ * slab pages) not holding requested bytes. It counts headers, padding
+ * and splinters; the compact layout has no room to remember padding, and
+ * slab objects count as fully used. External fragmentation is the share
+ * of free memory outside the largest free block. With MM_THREADS, payloads
+ * sitting in tcaches count as allocated, and so do blocks in quick bins.
+ */
+void mm_stats(void) {
+#if MM_STATS
+    counters_t total;
+    uint64_t allocBlocks = 0, allocBytes = 0, requested = 0;
+    uint64_t slabPages = 0, slabBytes = 0, slabLive = 0;
+    uint64_t freeBlocks = 0, freeBytes = 0, largest = 0;
+    block_t *block;
+    int i, c;
+
+    for (i = 0; i < NUM_ARENAS; i++)
+        ARENA_LOCK(&arenas[i]);
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < NUM_ARENAS; i++) {
+        counters_t *s = &arenas[i].stats;
+        total.fitCalls += s->fitCalls;
+        total.fitNodes += s->fitNodes;
+        total.fitCached += s->fitCached;
+        total.fitMisses += s->fitMisses;
+        for (c = 0; c < TOTALNUMLIST; c++)
+            total.classHits[c] += s->classHits[c];
+        total.placeSplits += s->placeSplits;
+        total.placeSplinters += s->placeSplinters;
+        for (c = 0; c < 4; c++)
+            total.coalesceCases[c] += s->coalesceCases[c];
+        total.extendCalls += s->extendCalls;
+        total.extendBytes += s->extendBytes;
+        total.trimCalls += s->trimCalls;
+        total.trimBytes += s->trimBytes;
+        total.quickHits += s->quickHits;
+        total.quickReleases += s->quickReleases;
+        total.callocCalls += s->callocCalls;
+        total.callocFresh += s->callocFresh;
+    }
+
+    /* walk the chunks the same way mm_checkheap does */
+    char *heap_end = (char *)mem_heap_hi() + 1;
+    for (char *chunk = heap_base; chunk < heap_end; chunk = (char *)block + sizeof(header_t)) {
+        for (block = next_block((block_t *)chunk); block->block_size > 0; block = next_block(block)) {
+            if (!block->allocated) {
+                freeBlocks++;
+                freeBytes += block->block_size;
+                if (block->block_size > largest)
+                    largest = block->block_size;
+            } else if (is_slab(block->body.payload)) {
+                slab_t *slab = (void *)block->body.payload;
+                slabPages++;
+                slabBytes += block->block_size;
+                slabLive += (uint64_t)slab->used * slab->size;
+            } else {
+                allocBlocks++;
+                allocBytes += block->block_size;
+#if COMPACT_LAYOUT
+                requested += block->block_size - OVERHEAD;
+#else
+                requested += block->block_size - OVERHEAD - block->slack;
+#endif
+            }
+        }
+    }
+    for (i = NUM_ARENAS - 1; i >= 0; i--)
+        ARENA_UNLOCK(&arenas[i]);
+
+    printf("find_fit: %lu calls, %.2f nodes per call (%.2f from the fit cache), %lu found nothing\n",
+           (unsigned long)total.fitCalls,
+           total.fitCalls ? (double)total.fitNodes / total.fitCalls : 0.0,
+           total.fitCalls ? (double)total.fitCached / total.fitCalls : 0.0,
+           (unsigned long)total.fitMisses);
+    printf("fits per size class (smallest block size: hits):");
+    for (c = 0, i = 0; c < TOTALNUMLIST; c++) {
+        if (total.classHits[c] == 0)
+            continue;
+        printf("%s%u: %lu", (i++ % 6) ? "  " : "\n    ", class_min_size(c),
+               (unsigned long)total.classHits[c]);
+    }
+    printf("\n");
+    printf("place: %lu splits, %lu splinters kept\n",
+           (unsigned long)total.placeSplits, (unsigned long)total.placeSplinters);
+    printf("coalesce: case 1 %lu, case 2 %lu, case 3 %lu, case 4 %lu\n",
+           (unsigned long)total.coalesceCases[0], (unsigned long)total.coalesceCases[1],
+           (unsigned long)total.coalesceCases[2], (unsigned long)total.coalesceCases[3]);
+    printf("extend_heap: %lu calls, %lu bytes\n",
+           (unsigned long)total.extendCalls, (unsigned long)total.extendBytes);
+    printf("trim_heap: %lu trims, %lu bytes\n",
+           (unsigned long)total.trimCalls, (unsigned long)total.trimBytes);
+    printf("calloc: %lu calls, %lu from fresh memory left as it was\n",
+           (unsigned long)total.callocCalls, (unsigned long)total.callocFresh);
+#if QUICK_BINS
+    printf("quick bins: %lu hits, %lu blocks released\n",
+           (unsigned long)total.quickHits, (unsigned long)total.quickReleases);
+#endif
+    printf("heap: %lu bytes, %lu allocated blocks (%lu bytes, %lu requested), "
+           "%lu slab pages (%lu bytes in use), %lu free blocks (%lu bytes, largest %lu)\n",
+           (unsigned long)mem_heapsize(), (unsigned long)allocBlocks,
+           (unsigned long)allocBytes, (unsigned long)requested,
+           (unsigned long)slabPages, (unsigned long)slabLive,
+           (unsigned long)freeBlocks, (unsigned long)freeBytes, (unsigned long)largest);
+    printf("fragmentation: internal %.1f%%, external %.1f%%\n",
+           allocBytes + slabBytes ? 100.0 * (1 - (double)(requested + slabLive) / (allocBytes + slabBytes)) : 0.0,
+           freeBytes ? 100.0 * (1 - (double)largest / freeBytes) : 0.0);
+#else
+    printf("mm_stats: not compiled in, build with MMFLAGS=-DMM_STATS=1\n");
+#endif
 }
 
 /* The remaining routines are internal helper routines */
@@ -254,62 +1627,263 @@ static inline int logBaseTwo(int input){
     return 31 - __builtin_clz(input);
 }
 
-static int segListIndex(int input){
-    //Blocks will be sent to lists depending on size (with a bias of -5, so smaller size blocks will all together (consequence of 2^n function starting slow and jumping up quickly))
-    int index = logBaseTwo(input) - 5;
-    //Put bounds on the index such that that maximum block sizes are restricted to a specific index of TOTALNUMLSIT - 5
-    return (index < (TOTALNUMLIST - 1)) ? index : (TOTALNUMLIST - 1);
+static int segListIndex(int input){
+    //Small blocks go to exact lists, one per SMALL_CLASS_STEP_BITS step
+    if (input < (1 << SMALL_CLASS_LIMIT_BITS))
+        return input >> SMALL_CLASS_STEP_BITS;
+    //Larger blocks are binned by power of two, then by the next SUB_CLASS_BITS bits
+    int fl = logBaseTwo(input);
+    int sl = (input >> (fl - SUB_CLASS_BITS)) & (SUB_CLASSES - 1);
+    return SMALL_CLASSES + (fl - SMALL_CLASS_LIMIT_BITS) * SUB_CLASSES + sl;
+}
+
+static inline void bitmap_set(arena_t *a, int index){
+    a->segListBitmap[index >> 6] |= 1ull << (index & 63);
+    a->segListSummary |= 1ull << (index >> 6);
+}
+
+static inline void bitmap_clear(arena_t *a, int index){
+    a->segListBitmap[index >> 6] &= ~(1ull << (index & 63));
+    if (a->segListBitmap[index >> 6] == 0)
+        a->segListSummary &= ~(1ull << (index >> 6));
+}
+
+/*
+ * bitmap_next - First non-empty list with index >= start, or -1 if none
+ */
+static inline int bitmap_next(arena_t *a, int start){
+    if (start >= TOTALNUMLIST)
+        return -1;
+    int word = start >> 6;
+    uint64_t bits = a->segListBitmap[word] & (~0ull << (start & 63));
+    if (bits == 0) {
+        //Use the summary word to skip every empty bitmap word at once
+        uint64_t words = (word + 1 < 64) ? a->segListSummary & (~0ull << (word + 1)) : 0;
+        if (words == 0)
+            return -1;
+        word = __builtin_ctzll(words);
+        bits = a->segListBitmap[word];
+    }
+    return (word << 6) + __builtin_ctzll(bits);
+}
+
+#if MM_STATS
+/*
+ * class_min_size - Smallest block size seg list index can hold
+ */
+static unsigned class_min_size(int index){
+    if (index < SMALL_CLASSES)
+        return index << SMALL_CLASS_STEP_BITS;
+    int fl = (index - SMALL_CLASSES) / SUB_CLASSES + SMALL_CLASS_LIMIT_BITS;
+    int sl = (index - SMALL_CLASSES) % SUB_CLASSES;
+    return (1u << fl) + ((unsigned)sl << (fl - SUB_CLASS_BITS));
+}
+#endif
+
+/*
+ * note_request - Remember in ptr's header how much of its block a request
+ *                for size bytes leaves unused, for mm_stats
+ */
+static void note_request(void *ptr, size_t size) {
+#if MM_STATS && !COMPACT_LAYOUT
+    block_t *block = ptr - sizeof(header_t);
+    size_t slack = block->block_size - OVERHEAD - size;
+    block->slack = slack < 63 ? slack : 63;
+#else
+    (void)ptr;
+    (void)size;
+#endif
+}
+
+/*
+ * adjust_size - Block size needed for a payload of size bytes, including
+ *               overhead and alignment. Returns 0 if it can't be represented.
+ */
+static uint32_t adjust_size(size_t size) {
+    if (size > MAX_BLOCK_SIZE - OVERHEAD)
+        return 0;
+    size += OVERHEAD;
+    uint32_t asize = ((size + 7) >> 3) << 3; /* align to multiple of 8 */
+    return (asize < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE : asize;
+}
+
+#if COMPACT_LAYOUT
+static inline block_t *link_to_block(link_t link){
+    return link ? (block_t *)(heap_base + link) : NULL;
+}
+
+static inline link_t block_to_link(block_t *block){
+    return block ? (link_t)((char *)block - heap_base) : 0;
+}
+#else
+static inline block_t *link_to_block(link_t link){ return link; }
+static inline link_t block_to_link(block_t *block){ return block; }
+#endif
+
+static inline block_t *list_next(block_t *block){
+    return link_to_block(block->body.next);
+}
+
+static inline block_t *list_prev(block_t *block){
+    return link_to_block(block->body.prev);
+}
+
+static inline void set_list_next(block_t *block, block_t *next){
+    block->body.next = block_to_link(next);
+}
+
+static inline void set_list_prev(block_t *block, block_t *prev){
+    block->body.prev = block_to_link(prev);
+}
+
+#if LIST_ORDER != LIST_LIFO
+//True iff block belongs ahead of newblock in an ordered list
+static inline bool list_before(block_t *block, block_t *newblock){
+#if LIST_ORDER == LIST_ADDRESS
+    return block < newblock;
+#else
+    return block->block_size < newblock->block_size;
+#endif
+}
+#endif
+
+/*
+ * block_merged - Note that block gone was absorbed into into, the block
+ *                before it, so mm_checkheap_step's cursor stays on a
+ *                block boundary
+ */
+static void block_merged(block_t *gone, block_t *into){
+    if (__atomic_load_n(&checkCursor, __ATOMIC_RELAXED) == gone)
+        __atomic_store_n(&checkCursor, into, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_insert - Note in the fit cache of list index that block was linked
+ *                in right after prev, or at the head if prev is NULL
+ */
+static inline void cache_insert(arena_t *a, int index, block_t *prev, block_t *block){
+#if FIT_CACHE
+    fit_cache_t *c = &a->fitCache[index];
+    uint32_t at = 0;
+
+    if (prev != NULL) {
+        while (at < c->count && c->block[at] != prev)
+            at++;
+        if (at++ == c->count)
+            return; /* prev is past the cached blocks, and so is block */
+    }
+    if (at == FIT_CACHE)
+        return;
+    if (c->count < FIT_CACHE)
+        c->count++;
+    for (uint32_t i = c->count - 1; i > at; i--) {
+        c->block[i] = c->block[i - 1];
+        c->size[i] = c->size[i - 1];
+    }
+    c->block[at] = block;
+    c->size[at] = block->block_size;
+#else
+    (void)a, (void)index, (void)prev, (void)block;
+#endif
+}
+
+/*
+ * cache_remove - Drop block from the fit cache of list index, if there
+ */
+static inline void cache_remove(arena_t *a, int index, block_t *block){
+#if FIT_CACHE
+    fit_cache_t *c = &a->fitCache[index];
+
+    for (uint32_t i = 0; i < c->count; i++) {
+        if (c->block[i] != block)
+            continue;
+        for (c->count--; i < c->count; i++) {
+            c->block[i] = c->block[i + 1];
+            c->size[i] = c->size[i + 1];
+        }
+        return;
+    }
+#else
+    (void)a, (void)index, (void)block;
+#endif
 }
 
 // Adding newly freed block onto linked list
-static void list_push(block_t *newblock, int index){
+static void list_push(arena_t *a, block_t *newblock, int index){
     
     //If list is empty
-    if(segListHead[index] == NULL){
-       segListHead[index] = newblock; 
-       newblock->body.prev = NULL;
-       newblock->body.next = NULL;
+    if(a->segListHead[index] == NULL){
+       a->segListHead[index] = newblock; 
+       bitmap_set(a, index);
+       set_list_prev(newblock, NULL);
+       set_list_next(newblock, NULL);
+       cache_insert(a, index, NULL, newblock);
+    }
+#if LIST_ORDER != LIST_LIFO
+    else{
+        //Find the first block that should come after newblock
+        block_t *prev = NULL, *next = a->segListHead[index];
+        while (next != NULL && list_before(next, newblock)) {
+            prev = next;
+            next = list_next(next);
+        }
+        set_list_next(newblock, next);
+        set_list_prev(newblock, prev);
+        if (next != NULL)
+            set_list_prev(next, newblock);
+        if (prev != NULL)
+            set_list_next(prev, newblock);
+        else
+            a->segListHead[index] = newblock;
+        cache_insert(a, index, prev, newblock);
     }
+#else
     else{
         //Setting up newblock pointers
-    newblock->body.next = segListHead[index];
-    newblock->body.prev = NULL; 
-    segListHead[index]->body.prev = newblock;
-    segListHead[index] = newblock;
+    set_list_next(newblock, a->segListHead[index]);
+    set_list_prev(newblock, NULL);
+    set_list_prev(a->segListHead[index], newblock);
+    a->segListHead[index] = newblock;
+    cache_insert(a, index, NULL, newblock);
     }
+#endif
     
     return;
 }
 
 // Removing free block from list
-static void list_pop(block_t *removeblock, int index){
+static void list_pop(arena_t *a, block_t *removeblock, int index){
+    block_t *next = list_next(removeblock);
+    block_t *prev = list_prev(removeblock);
+
+    cache_remove(a, index, removeblock);
 
     //Case 1 (Only block in list)
-    if(removeblock->body.prev == NULL && removeblock->body.next == NULL){
-        segListHead[index] = NULL;
+    if(prev == NULL && next == NULL){
+        a->segListHead[index] = NULL;
+        bitmap_clear(a, index);
         return;
     }
 
     //Case 2 (First block in list)
-    else if(segListHead[index] == removeblock){
-        segListHead[index] = removeblock->body.next;
-        removeblock->body.next->body.prev = NULL;
+    else if(a->segListHead[index] == removeblock){
+        a->segListHead[index] = next;
+        set_list_prev(next, NULL);
 
         return;
     }
     //Case 3 (Last block in list)
-    else if(removeblock->body.next == NULL){
-        removeblock->body.prev->body.next = NULL;
+    else if(next == NULL){
+        set_list_next(prev, NULL);
 
         return;
     }
     //Case 4 (Middle of list)
     else{
         //Set pointers for next block
-        removeblock->body.next->body.prev = removeblock->body.prev;
+        set_list_prev(next, prev);
         //Set pointer for previous block
-        removeblock->body.prev->body.next = removeblock->body.next;
-        //null out removeblock pointer
+        set_list_next(prev, next);
 
         return;
     }
@@ -317,113 +1891,580 @@ static void list_pop(block_t *removeblock, int index){
 }
 
 /*
- * extend_heap - Extend heap with free block and return its block pointer
+ * extend_heap - Extend arena a with a free block and return its block pointer
+ *
+ * The arena's newest chunk grows in place while its epilogue ends the heap.
+ * Otherwise (no chunk yet, or another arena grew since) a new chunk with its
+ * own prologue and epilogue is started. With align non-zero the block gets
+ * enough extra room in front for an aligned payload of words*8 bytes.
  */
 /* $begin mmextendheap */
-static block_t *extend_heap(size_t words, bool willCoalesce) {
+static block_t *extend_heap(arena_t *a, size_t words, size_t align) {
     block_t *block;
-    uint32_t size;
+    size_t size;
     size = words << 3; // words*8
-    if (size == 0 || (block = mem_sbrk(size)) == (void *)-1)
+    if (size == 0)
+        return NULL;
+    GROW_LOCK();
+    char *end = (char *)mem_heap_hi() + 1;
+    bool in_place = a->epilogue != NULL && (char *)a->epilogue + sizeof(header_t) == end;
+    /* a new chunk needs a prologue in front and an epilogue of its own */
+    size_t chunk_overhead = in_place ? 0 : 2 * sizeof(header_t);
+    if (align != 0)
+        size += aligned_lead(end + chunk_overhead, align);
+    char *zero = mem_zero_lo();
+    if (size > MAX_BLOCK_SIZE || mem_sbrk(size + chunk_overhead) == (void *)-1) {
+        GROW_UNLOCK();
         return NULL;
-    /* The newly acquired region will start directly after the epilogue block */ 
+    }
+    GROW_UNLOCK();
+    STAT_INC(a, extendCalls);
+    STAT_ADD(a, extendBytes, size + chunk_overhead);
+    if (in_place) {
+        /* The newly acquired region will start directly after the epilogue block */
+        /* use old epilogue as new free block header */
+        /* (its prev_allocated bit is already right) */
+        block = (void *)a->epilogue;
+    } else {
+        block_t *prologue = (void *)end;
+        prologue->allocated = ALLOC;
+        prologue->prev_allocated = ALLOC;
+        prologue->block_size = sizeof(header_t);
+        block = (void *)prologue + sizeof(header_t);
+        block->prev_allocated = ALLOC;
+    }
     /* Initialize free block header/footer and the new epilogue header */
-    /* use old epilogue as new free block header */
-    block = (void *)block - sizeof(header_t);
     block->allocated = FREE;
     block->block_size = size;
     /* free block footer */
-    footer_t *block_footer = get_footer(block);
-    block_footer->allocated = FREE;
-    block_footer->block_size = block->block_size;
-    /* new epilogue header */
-    header_t *new_epilogue = (void *)block_footer + sizeof(header_t);
+    set_footer(block);
+    /* new epilogue header - block size 0 will be used as a terminating condition */
+    block_t *new_epilogue = next_block(block);
     new_epilogue->allocated = ALLOC;
+    new_epilogue->prev_allocated = FREE;
     new_epilogue->block_size = 0;
+    a->epilogue = new_epilogue;
+    /* list_push writes the block's links, which coalesce may leave in the
+       middle of a merged block, so only what lies above them reads as zero */
+    char *links = (char *)block + sizeof(header_t) + 2 * sizeof(link_t);
+    a->fresh = zero > links ? zero : links;
     /* Coalesce if the previous block was free */
     //Creating new segList block
     int blockIndex = segListIndex(block->block_size);
-    list_push(block, blockIndex);
-    if(willCoalesce == true){
-        return coalesce(block);
-    }
-    else return block;
+    list_push(a, block, blockIndex);
+    return coalesce(a, block);
 }
 /* $end mmextendheap */
 
+/*
+ * trim_heap - Shrink the heap if free block block is the last one of
+ *             arena a, a's chunk ends the heap and the block has reached
+ *             TRIM_THRESHOLD bytes. About TRIM_PAD bytes are kept, enough
+ *             to end the heap on a page boundary.
+ */
+static void trim_heap(arena_t *a, block_t *block) {
+#if TRIM_THRESHOLD
+    if (block->block_size < TRIM_THRESHOLD || next_block(block) != a->epilogue)
+        return;
+    uintptr_t page = mem_pagesize();
+    uintptr_t end = ((uintptr_t)block + TRIM_PAD + sizeof(header_t) + page - 1) & ~(page - 1);
+    size_t keep = end - sizeof(header_t) - (uintptr_t)block;
+    size_t release = block->block_size - keep;
+    if (keep >= block->block_size || release < page)
+        return;
+    GROW_LOCK();
+    if ((char *)a->epilogue + sizeof(header_t) != (char *)mem_heap_hi() + 1 ||
+        mem_sbrk(-(int)release) == (void *)-1) {
+        GROW_UNLOCK();
+        return;
+    }
+    GROW_UNLOCK();
+    STAT_INC(a, trimCalls);
+    STAT_ADD(a, trimBytes, release);
+    list_pop(a, block, segListIndex(block->block_size));
+    block->block_size = keep;
+    set_footer(block);
+    list_push(a, block, segListIndex(block->block_size));
+    block_t *new_epilogue = next_block(block);
+    new_epilogue->allocated = ALLOC;
+    new_epilogue->prev_allocated = FREE;
+    new_epilogue->block_size = 0;
+    a->epilogue = new_epilogue;
+    /* a cursor past block was left in the memory given back */
+    if (__atomic_load_n(&checkCursor, __ATOMIC_RELAXED) > block)
+        __atomic_store_n(&checkCursor, NULL, __ATOMIC_RELAXED);
+#endif
+}
+
+/*
+ * block_alloc - Allocate a block of asize bytes from the seg lists,
+ *               growing the heap if nothing fits
+ */
+static void *block_alloc(arena_t *a, uint32_t asize) {
+    uint32_t extendsize;  /* amount to extend heap if no fit */
+    block_t *block;
+
+#if QUICK_BINS
+    /* A quick bin block of the exact size is already allocated */
+    if (asize <= QUICK_MAX_SIZE && (block = a->quickBin[asize >> 3]) != NULL) {
+        a->quickBin[asize >> 3] = list_next(block);
+        a->quickCount[asize >> 3]--;
+        a->quickBlocks--;
+        STAT_INC(a, quickHits);
+        return block->body.payload;
+    }
+#endif
+
+    /* Search the free list for a fit */
+    block = find_fit(a, asize);
+#if MM_THREADS
+    /* Frees pushed since the arena was acquired may leave a fit */
+    if (block == NULL && remote_drain(a))
+        block = find_fit(a, asize);
+#endif
+#if QUICK_BINS
+    /* Coalesce what the quick bins hold before growing the heap */
+    if (block == NULL && quick_release_all(a))
+        block = find_fit(a, asize);
+#endif
+    if (block != NULL) {
+        place(a, block, asize);
+        return block->body.payload;
+    }
+
+    /* No fit found. Get more memory and place the block */
+    extendsize = (asize > CHUNKSIZE) // extend by the larger of the two
+                     ? asize
+                     : CHUNKSIZE;
+    if ((block = extend_heap(a, extendsize >> 3, 0)) != NULL) {
+        place(a, block, asize);
+        return block->body.payload;
+    }
+    /* no more memory :( */
+    return NULL;
+}
+
+/*
+ * aligned_lead - Bytes to skip from payload so that it becomes a multiple
+ *                of align, leaving room for a free block in front if needed
+ */
+static size_t aligned_lead(char *payload, size_t align) {
+    size_t lead = (align - (uintptr_t)payload % align) % align;
+    /* the slack must hold a free block, which may take several aligns */
+    if (lead != 0 && lead < MIN_BLOCK_SIZE)
+        lead += (MIN_BLOCK_SIZE - lead + align - 1) & ~(align - 1);
+    return lead;
+}
+
+/*
+ * block_alloc_aligned - Like block_alloc, but the payload address is a
+ *     multiple of align (a power of two, at least 8). The slack in front
+ *     of it goes back to the seg lists as a free block of its own.
+ */
+static void *block_alloc_aligned(arena_t *a, uint32_t asize, size_t align) {
+    block_t *block;
+    size_t lead;
+
+    /* a block this big fits whatever its address, and has to be possible */
+    if ((size_t)asize + align + MIN_BLOCK_SIZE > MAX_BLOCK_SIZE)
+        return NULL;
+    uint32_t worst = asize + align + MIN_BLOCK_SIZE;
+
+    block = find_aligned_fit(a, asize, align, worst);
+#if MM_THREADS
+    if (block == NULL && remote_drain(a))
+        block = find_aligned_fit(a, asize, align, worst);
+#endif
+#if QUICK_BINS
+    if (block == NULL && quick_release_all(a))
+        block = find_aligned_fit(a, asize, align, worst);
+#endif
+    if (block == NULL && !a->epilogue->prev_allocated) {
+        /* grow the free block that ends the arena by just what it lacks */
+        footer_t *footer = (void *)a->epilogue - sizeof(footer_t);
+        block_t *tail = (void *)a->epilogue - footer->block_size;
+        size_t need = aligned_lead((char *)tail->body.payload, align) + asize;
+        size_t grow = need > tail->block_size + MIN_BLOCK_SIZE ? need - tail->block_size
+                                                               : MIN_BLOCK_SIZE;
+        block = extend_heap(a, grow >> 3, 0);
+        /* another arena may have grown meanwhile, then block is a new chunk */
+        if (block != NULL &&
+            aligned_lead((char *)block->body.payload, align) + asize > block->block_size)
+            block = NULL;
+    }
+    if (block == NULL) {
+        /* grow the arena just enough for an aligned block at its end */
+        if ((block = extend_heap(a, asize >> 3, align)) == NULL)
+            return NULL;
+    }
+
+    lead = aligned_lead((char *)block->body.payload, align);
+    if (lead != 0) {
+        /* split the slack off and give it back as a free block */
+        uint32_t rest_size = block->block_size - lead;
+        list_pop(a, block, segListIndex(block->block_size));
+        block->block_size = lead;
+        set_footer(block);
+        list_push(a, block, segListIndex(block->block_size));
+        block = next_block(block);
+        block->block_size = rest_size;
+        block->allocated = FREE;
+        block->prev_allocated = FREE;
+        set_footer(block);
+        list_push(a, block, segListIndex(block->block_size));
+    }
+    place(a, block, asize);
+    return block->body.payload;
+}
+
+/*
+ * block_free - Return an allocated block to a quick bin or the seg lists
+ */
+static void block_free(arena_t *a, block_t *block) {
+#if QUICK_BINS
+    if (block->block_size <= QUICK_MAX_SIZE) {
+        int bin = block->block_size >> 3;
+        set_list_next(block, a->quickBin[bin]);
+        a->quickBin[bin] = block;
+        a->quickBlocks++;
+        if (++a->quickCount[bin] >= QUICK_BIN_COUNT)
+            quick_release(a, bin);
+        return;
+    }
+#endif
+    block_release(a, block);
+}
+
+#if QUICK_BINS
+/*
+ * quick_release - Free every block of a quick bin into the seg lists
+ */
+static void quick_release(arena_t *a, int bin) {
+    block_t *block = a->quickBin[bin], *next;
+
+    STAT_ADD(a, quickReleases, a->quickCount[bin]);
+    a->quickBlocks -= a->quickCount[bin];
+    a->quickBin[bin] = NULL;
+    a->quickCount[bin] = 0;
+    for (; block != NULL; block = next) {
+        next = list_next(block);
+        block_release(a, block);
+    }
+}
+
+/*
+ * quick_release_all - Empty all quick bins, false if they were empty
+ */
+static bool quick_release_all(arena_t *a) {
+    if (a->quickBlocks == 0)
+        return false;
+    for (int bin = 0; bin < QUICK_CLASSES; bin++)
+        if (a->quickBin[bin] != NULL)
+            quick_release(a, bin);
+    return true;
+}
+#endif
+
+/*
+ * block_release - Return an allocated block to the seg lists right away
+ */
+static void block_release(arena_t *a, block_t *block) {
+#if PREFETCH_FIT
+    /* coalesce unlinks free neighbours, start fetching them and their list
+       neighbours now */
+    block_t *next = next_block(block);
+    if (!block->prev_allocated)
+        __builtin_prefetch((void *)block - ((footer_t *)block - 1)->block_size);
+    if (!next->allocated) {
+        __builtin_prefetch(list_next(next));
+        __builtin_prefetch(list_prev(next));
+    }
+#endif
+    block->allocated = FREE;
+    set_footer(block);
+    next_block(block)->prev_allocated = FREE;
+    int freeIndex = segListIndex(block->block_size);
+    list_push(a, block, freeIndex);
+    trim_heap(a, coalesce(a, block));
+}
+
 /*
  * place - Place block of asize bytes at start of free block block
  *         and split if remainder would be at least minimum block size
  */
 /* $begin mmplace */
-static void place(block_t *block, size_t asize) {
+static void place(arena_t *a, block_t *block, size_t asize) {
     size_t split_size = block->block_size - asize;
     if (split_size >= MIN_BLOCK_SIZE) {
         int indexNum = segListIndex(block->block_size);
         //Remove block from free list
-        list_pop(block, indexNum);
+        list_pop(a, block, indexNum);
         /* split the block by updating the header and marking it allocated*/
         block->block_size = asize;
         block->allocated = ALLOC;
-        /* set footer of allocated block*/
-        footer_t *footer = get_footer(block);
-        footer->block_size = asize;
-        footer->allocated = ALLOC;
         /* update the header of the new free block */
-        block_t *new_block = (void *)block + block->block_size;
+        block_t *new_block = next_block(block);
         new_block->block_size = split_size;
         new_block->allocated = FREE;
+        new_block->prev_allocated = ALLOC;
         /* update the footer of the new free block */
-        footer_t *new_footer = get_footer(new_block);
-        new_footer->block_size = split_size;
-        new_footer->allocated = FREE;
+        set_footer(new_block);
         //Add new_block to list
         indexNum = segListIndex(new_block->block_size);
-        list_push(new_block, indexNum);
+        list_push(a, new_block, indexNum);
+        STAT_INC(a, placeSplits);
     } else {
         int indexNum = segListIndex(block->block_size);
-        list_pop(block, indexNum);
+        list_pop(a, block, indexNum);
         /* splitting the block will cause a splinter so we just include it in the allocated block */
         block->allocated = ALLOC;
-        footer_t *footer = get_footer(block);
-        footer->allocated = ALLOC;
+        next_block(block)->prev_allocated = ALLOC;
+        STAT_INC(a, placeSplinters);
     }
+#if NUM_ARENAS > 1
+    /* lets mm_free find the owner without any lock */
+    block->arena = a->id;
+#endif
 }
 /* $end mmplace */
 
+/*
+ * place_run - Carve up to n blocks of asize bytes, back to back, out of
+ *             free block block, and store their payloads in out[]. The
+ *             free block leaves its list once and what is left of it goes
+ *             back once, however many blocks are carved. Returns how many.
+ */
+static size_t place_run(arena_t *a, block_t *block, uint32_t asize, size_t n, void **out) {
+    size_t left = block->block_size, k = left / asize;
+    block_t *last = NULL;
+
+    if (k > n)
+        k = n;
+    list_pop(a, block, segListIndex(block->block_size));
+    for (size_t i = 0; i < k; i++) {
+        /* the first block keeps its own prev_allocated bit */
+        if (last != NULL)
+            block->prev_allocated = ALLOC;
+        block->block_size = asize;
+        block->allocated = ALLOC;
+#if NUM_ARENAS > 1
+        block->arena = a->id;
+#endif
+        out[i] = block->body.payload;
+        left -= asize;
+        last = block;
+        block = next_block(block);
+    }
+    if (left >= MIN_BLOCK_SIZE) {
+        /* the rest stands on its own as a free block */
+        block->block_size = left;
+        block->allocated = FREE;
+        block->prev_allocated = ALLOC;
+        set_footer(block);
+        list_push(a, block, segListIndex(block->block_size));
+        STAT_INC(a, placeSplits);
+    } else {
+        /* a splinter goes to the last block */
+        last->block_size += left;
+        next_block(last)->prev_allocated = ALLOC;
+        STAT_INC(a, placeSplinters);
+    }
+    return k;
+}
+
+/*
+ * block_alloc_batch - Allocate n blocks of asize bytes into out[], taking
+ *                     each free block big enough for all that are left
+ *                     first. Returns how many, fewer only without memory.
+ */
+static size_t block_alloc_batch(arena_t *a, uint32_t asize, size_t n, void **out) {
+    size_t got = 0;
+    block_t *block;
+
+#if QUICK_BINS
+    /* blocks of exactly this size freed earlier come first */
+    while (got < n && asize <= QUICK_MAX_SIZE && a->quickBin[asize >> 3] != NULL) {
+        block = a->quickBin[asize >> 3];
+        a->quickBin[asize >> 3] = list_next(block);
+        a->quickCount[asize >> 3]--;
+        a->quickBlocks--;
+        STAT_INC(a, quickHits);
+        out[got++] = block->body.payload;
+    }
+#endif
+    while (got < n) {
+        size_t want = n - got;
+        if (want > MAX_BLOCK_SIZE / asize)
+            want = MAX_BLOCK_SIZE / asize;
+        /* one block for the whole rest, else any fit, else a new one */
+        if ((block = find_fit(a, want * asize)) == NULL &&
+            (block = find_fit(a, asize)) == NULL) {
+#if MM_THREADS
+            if (remote_drain(a))
+                continue;
+#endif
+#if QUICK_BINS
+            if (quick_release_all(a))
+                continue;
+#endif
+            size_t extendsize = want * asize > CHUNKSIZE ? want * asize : CHUNKSIZE;
+            if ((block = extend_heap(a, extendsize >> 3, 0)) == NULL)
+                break;
+        }
+        got += place_run(a, block, asize, want, out + got);
+    }
+    return got;
+}
+
+/*
+ * shrink_block - Trim an allocated block down to asize bytes, giving the
+ *                tail back to the seg lists if it can stand on its own
+ */
+static void shrink_block(arena_t *a, block_t *block, size_t asize) {
+    size_t split_size = block->block_size - asize;
+    if (split_size < MIN_BLOCK_SIZE)
+        return;
+    block->block_size = asize;
+    /* the tail becomes a free block and merges with a free successor */
+    block_t *tail = next_block(block);
+    tail->block_size = split_size;
+    tail->allocated = FREE;
+    tail->prev_allocated = ALLOC;
+    set_footer(tail);
+    next_block(tail)->prev_allocated = FREE;
+    list_push(a, tail, segListIndex(tail->block_size));
+    trim_heap(a, coalesce(a, tail));
+}
+
 /*
  * find_fit - Find a fit for a block with asize bytes
+ *
+ * Only the request's own list can hold blocks that are too small, so it is
+ * the only one walked. Every block in a higher list fits, so the first
+ * non-empty one (found from segListBitmap) is served from its head.
  */
-static block_t *find_fit(size_t asize) {
-    /* first fit search */
-    block_t *b;
-    int sizeIndex = segListIndex(asize);
+/*
+ * fit_consider - Weigh free block b of size bytes for find_fit, keeping
+ *                the tightest fit so far; true once the search can stop
+ */
+static inline bool fit_consider(int policy, size_t asize, block_t *b, uint32_t size,
+                                block_t **fit, uint32_t *fitSize, int *fits) {
+    /* the size must be large enough to hold the request */
+    if (asize > size)
+        return false;
+    if (*fit == NULL || size < *fitSize) {
+        *fit = b;
+        *fitSize = size;
+    }
+    /* first fit takes it, and is already the best in a size sorted
+       list; the others only stop early on an exact fit */
+    return policy == FIT_FIRST || LIST_ORDER == LIST_SIZE || size == asize ||
+           (policy == FIT_GOOD && ++*fits == FIT_K);
+}
 
-    //Indexing over different segLists
-    for(int i = sizeIndex; i < TOTALNUMLIST; i++){
+static block_t *find_fit(arena_t *a, size_t asize) {
+    block_t *b, *next, *fit = NULL;
+    uint32_t fitSize = 0;
+    int sizeIndex = segListIndex(asize);
+    int policy = __atomic_load_n(&fitPolicy, __ATOMIC_RELAXED);
+    int fits = 0;
+    bool stop = false;
 
+    STAT_INC(a, fitCalls);
     //Starting at first block traverse using next pointers
-    for (b = segListHead[i]; b != NULL; b = b->body.next) {  //
-        /* block must be free and the size must be large enough to hold the request */
-        if (!b->allocated && asize <= b->block_size) {
-            return b;
+    if (a->segListBitmap[sizeIndex >> 6] & (1ull << (sizeIndex & 63))) {
+        b = a->segListHead[sizeIndex];
+#if FIT_CACHE
+        /* the first blocks are checked from the side array, then the walk
+           goes on from the last of them and refills it */
+        fit_cache_t *c = &a->fitCache[sizeIndex];
+        for (uint32_t i = 0; i < c->count && !stop; i++) {
+            STAT_INC(a, fitNodes);
+            STAT_INC(a, fitCached);
+            stop = fit_consider(policy, asize, c->block[i], c->size[i], &fit, &fitSize, &fits);
+        }
+        if (stop)
+            b = NULL;
+        else if (c->count > 0)
+            b = list_next(c->block[c->count - 1]);
+#endif
+        for (; b != NULL && !stop; b = next) {
+            next = list_next(b);
+            if (PREFETCH_FIT && next != NULL)
+                __builtin_prefetch(next);
+#if FIT_CACHE
+            if (c->count < FIT_CACHE) {
+                c->block[c->count] = b;
+                c->size[c->count++] = b->block_size;
+            }
+#endif
+            STAT_INC(a, fitNodes);
+            stop = fit_consider(policy, asize, b, b->block_size, &fit, &fitSize, &fits);
         }
+        if (fit != NULL) {
+            STAT_INC(a, classHits[sizeIndex]);
+            return fit;
+        }
+    }
+
+    //Jump straight to the first non-empty list above the request's list
+    int larger = bitmap_next(a, sizeIndex + 1);
+    if (larger < 0) {
+        STAT_INC(a, fitMisses);
+        return NULL; /* no fit */
     }
+    STAT_INC(a, fitNodes);
+    STAT_INC(a, classHits[larger]);
+    return a->segListHead[larger];
 }
-    return NULL; /* no fit */
+
+/*
+ * find_aligned_fit - First free block that holds asize bytes at a multiple
+ *     of align once its front slack is split off. The lists up to the one
+ *     of worst, the size that always fits, are walked block by block;
+ *     above it the head of the first non-empty list is taken.
+ */
+static block_t *find_aligned_fit(arena_t *a, uint32_t asize, size_t align, uint32_t worst) {
+    int last = segListIndex(worst);
+
+    STAT_INC(a, fitCalls);
+    for (int i = bitmap_next(a, segListIndex(asize)); i >= 0 && i <= last;
+         i = bitmap_next(a, i + 1)) {
+        for (block_t *b = a->segListHead[i]; b != NULL; b = list_next(b)) {
+            STAT_INC(a, fitNodes);
+            if (b->block_size >= asize &&
+                aligned_lead((char *)b->body.payload, align) + asize <= b->block_size)
+                return b;
+        }
+    }
+    int larger = bitmap_next(a, last + 1);
+    if (larger < 0) {
+        STAT_INC(a, fitMisses);
+        return NULL;
+    }
+    return a->segListHead[larger];
 }
 
 /*
  * coalesce - boundary tag coalescing. Return ptr to coalesced block
  */
-static block_t *coalesce(block_t *block) {
-    footer_t *prev_footer = (void *)block - sizeof(header_t);
+static block_t *coalesce(arena_t *a, block_t *block) {
     header_t *next_header = (void *)block + block->block_size;
-    bool prev_alloc = prev_footer->allocated;
+    bool prev_alloc = block->prev_allocated;
     bool next_alloc = next_header->allocated;
     block_t *next_block = (void *)next_header;
-    block_t *prev_block = (void *)prev_footer - prev_footer->block_size + sizeof(header_t);
+    /* only free blocks have a footer, so only look for one if prev is free */
+    footer_t *prev_footer = (void *)block - sizeof(footer_t);
+    block_t *prev_block = prev_alloc ? NULL : (void *)block - prev_footer->block_size;
+
+    /* never build a block bigger than the block_size field can hold */
+    if (!next_alloc && (size_t)block->block_size + next_block->block_size > MAX_BLOCK_SIZE)
+        next_alloc = true;
+    if (!prev_alloc && (size_t)prev_block->block_size + block->block_size +
+                               (next_alloc ? 0 : next_block->block_size) > MAX_BLOCK_SIZE)
+        prev_alloc = true;
 
+    STAT_INC(a, coalesceCases[!prev_alloc << 1 | !next_alloc]);
     if (prev_alloc && next_alloc) { /* Case 1 */
         /* no coalesceing */
         return block;
@@ -431,83 +2472,437 @@ static block_t *coalesce(block_t *block) {
 
     else if (prev_alloc && !next_alloc) { /* Case 2 */
         int coalesceIndex = segListIndex(block->block_size);
-        list_pop(block, coalesceIndex);
+        list_pop(a, block, coalesceIndex);
          coalesceIndex = segListIndex(next_block->block_size);
-        list_pop(next_block, coalesceIndex);
+        list_pop(a, next_block, coalesceIndex);
         /* Update header of current block o include next block's size */
+        block_merged(next_block, block);
         block->block_size += next_header->block_size;
         /* Update footer of next block to reflect new size */
-        footer_t *next_footer = get_footer(block);
-        next_footer->block_size = block->block_size;
+        set_footer(block);
         //Remove *2nd* part of block from list
         coalesceIndex = segListIndex(block->block_size);
-        list_push(block, coalesceIndex);
+        list_push(a, block, coalesceIndex);
     }
 
     else if (!prev_alloc && next_alloc) { /* Case 3 */
         int coalesceIndex = segListIndex(block->block_size);
-        list_pop(block, coalesceIndex);
+        list_pop(a, block, coalesceIndex);
          coalesceIndex = segListIndex(prev_block->block_size);
-        list_pop(prev_block, coalesceIndex);
+        list_pop(a, prev_block, coalesceIndex);
         /* Update header of prev block to include current block's size */
+        block_merged(block, prev_block);
         prev_block->block_size += block->block_size;
         /* Update footer of current block to reflect new size */
-        footer_t *footer = get_footer(prev_block);
-        footer->block_size = prev_block->block_size;
+        set_footer(prev_block);
         block = prev_block;
          coalesceIndex = segListIndex(block->block_size);
-        list_push(block, coalesceIndex);
+        list_push(a, block, coalesceIndex);
     }
 
     else { /* Case 4 */
     int coalesceIndex = segListIndex(prev_block->block_size);
-        list_pop(prev_block, coalesceIndex);
+        list_pop(a, prev_block, coalesceIndex);
         coalesceIndex = segListIndex(block->block_size);
-        list_pop(block, coalesceIndex);
+        list_pop(a, block, coalesceIndex);
         coalesceIndex = segListIndex(next_block->block_size);
-        list_pop(next_block, coalesceIndex);
+        list_pop(a, next_block, coalesceIndex);
         /* Update header of prev block to include current and next block's size */
-        block_t *prev_block = (void *)prev_footer - prev_footer->block_size + sizeof(header_t);
+        block_merged(block, prev_block);
+        block_merged(next_block, prev_block);
         prev_block->block_size += block->block_size + next_header->block_size;
         /* Update footer of next block to reflect new size */
-        footer_t *next_footer = get_footer(prev_block);
-        next_footer->block_size = prev_block->block_size;
+        set_footer(prev_block);
         //Change pointers of list
         block = prev_block;
         coalesceIndex = segListIndex(block->block_size);
-        list_push(block, coalesceIndex);
+        list_push(a, block, coalesceIndex);
     }
     return block;
 }
 
+/*
+ * The following routines pick and find arenas
+ */
+
+/*
+ * arena_acquire - Lock an arena for the calling thread to allocate from.
+ *     The thread's own arena is tried first; when it is busy the first idle
+ *     one is taken instead and becomes the thread's arena from then on. Only
+ *     if every arena is busy does the thread wait for its own. Frees other
+ *     threads left on the arena's remote stack are done before returning,
+ *     and again by the allocators before they grow the heap.
+ */
+static arena_t *arena_acquire(void) {
+#if MM_THREADS
+    int home = threadArena;
+    if (home < 0 || home >= (int)numArenas) {
+        int cpu = ARENA_BY_CPU ? sched_getcpu() : -1;
+        if (cpu < 0)
+            cpu = __atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED);
+        home = threadArena = cpu % numArenas;
+    }
+    arena_t *a = &arenas[home];
+    if (pthread_mutex_trylock(&a->lock) != 0) {
+        unsigned i;
+        for (i = 1; i < numArenas; i++) {
+            a = &arenas[(home + i) % numArenas];
+            if (pthread_mutex_trylock(&a->lock) == 0)
+                break;
+        }
+        if (i < numArenas) {
+            threadArena = a->id;
+        } else {
+            a = &arenas[home];
+            ARENA_LOCK(a);
+        }
+    }
+    remote_drain(a);
+    return a;
+#else
+    return &arenas[0];
+#endif
+}
+
+/*
+ * payload_arena - Arena owning ptr, a live allocation of size bytes, 0 if
+ *                 unknown. Needs no lock: like block_size in usable_size,
+ *                 the tag can't change while ptr is live, whatever
+ *                 neighbours do to the rest of its word.
+ */
+static arena_t *payload_arena(void *ptr, size_t size) {
+#if NUM_ARENAS > 1
+    /* slab objects belong to the arena of the block holding their page;
+       a known size above SLAB_MAX_SIZE rules one out */
+    if (size <= SLAB_MAX_SIZE && is_slab(ptr))
+        ptr = (void *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    block_t *block = ptr - sizeof(header_t);
+    return &arenas[block->arena];
+#else
+    (void)ptr;
+    (void)size;
+    return &arenas[0];
+#endif
+}
+
+/*
+ * The following routines implement the slab layer for tiny requests
+ */
+
+static inline size_t slab_page_index(void *ptr) {
+    return ((uintptr_t)ptr >> SLAB_PAGE_BITS) - ((uintptr_t)heap_base >> SLAB_PAGE_BITS);
+}
+
+/*
+ * is_slab - True iff ptr was handed out by slab_alloc
+ */
+static bool is_slab(void *ptr) {
+    size_t page = slab_page_index(ptr);
+    /* other bits of the byte may change under us, ours can't while ptr is live */
+    return (__atomic_load_n(&slabPageMap[page >> 3], __ATOMIC_RELAXED) >> (page & 7)) & 1;
+}
+
+static inline void slab_list_remove(arena_t *a, slab_t *slab, int cls) {
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        a->slabPartial[cls] = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+}
+
+static inline void slab_list_push(arena_t *a, slab_t *slab, int cls) {
+    slab->prev = NULL;
+    slab->next = a->slabPartial[cls];
+    if (slab->next)
+        slab->next->prev = slab;
+    a->slabPartial[cls] = slab;
+}
+
+/*
+ * slab_new - Carve a fresh, page aligned slab for class cls out of the heap
+ */
+static slab_t *slab_new(arena_t *a, int cls) {
+    slab_t *slab = block_alloc_aligned(a, adjust_size(SLAB_PAGE_SIZE), SLAB_PAGE_SIZE);
+    if (slab == NULL)
+        return NULL;
+    slab->size = cls << 3;
+    slab->used = 0;
+    slab->free = NULL;
+    slab->bump = (char *)slab + SLAB_HEADER;
+    slab->end = slab->bump + (SLAB_PAGE_SIZE - SLAB_HEADER) / slab->size * slab->size;
+    slab_list_push(a, slab, cls);
+
+    size_t page = slab_page_index(slab);
+    __atomic_fetch_or(&slabPageMap[page >> 3], 1 << (page & 7), __ATOMIC_RELAXED);
+    /* slabs of other arenas may be created meanwhile, so raise it atomically */
+    size_t hi = __atomic_load_n(&slabPageMapHi, __ATOMIC_RELAXED);
+    while ((page >> 3) + 1 > hi &&
+           !__atomic_compare_exchange_n(&slabPageMapHi, &hi, (page >> 3) + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return slab;
+}
+
+/*
+ * slab_alloc - Hand out an object of at least size bytes from a slab
+ */
+static void *slab_alloc(arena_t *a, size_t size) {
+    int cls = (size + 7) >> 3;
+    slab_t *slab = a->slabPartial[cls];
+    void *obj;
+
+    if (slab == NULL && (slab = slab_new(a, cls)) == NULL)
+        return NULL;
+
+    if (slab->free != NULL) {
+        obj = slab->free;
+        slab->free = *(void **)obj;
+    } else {
+        obj = slab->bump;
+        slab->bump += slab->size;
+    }
+    slab->used++;
+
+    /* a full slab leaves the partial list until one of its objects is freed */
+    if (slab->free == NULL && slab->bump == slab->end)
+        slab_list_remove(a, slab, cls);
+    return obj;
+}
+
+/*
+ * slab_free - Give an object back to its slab. An empty slab goes back to
+ *             the seg lists unless it is the last one its class has.
+ */
+static void slab_free(arena_t *a, void *ptr) {
+    slab_t *slab = (void *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+    int cls = slab->size >> 3;
+    bool was_full = (slab->free == NULL && slab->bump == slab->end);
+
+    *(void **)ptr = slab->free;
+    slab->free = ptr;
+    slab->used--;
+
+    if (was_full)
+        slab_list_push(a, slab, cls);
+    else if (slab->used == 0 && (slab->prev != NULL || slab->next != NULL)) {
+        slab_list_remove(a, slab, cls);
+        size_t page = slab_page_index(slab);
+        __atomic_fetch_and(&slabPageMap[page >> 3], ~(1 << (page & 7)), __ATOMIC_RELAXED);
+        block_free(a, (void *)slab - sizeof(header_t));
+    }
+}
+
+/*
+ * usable_size - Payload bytes available at ptr, a live heap allocation
+ */
+static size_t usable_size(void *ptr) {
+    if (is_slab(ptr)) {
+        slab_t *slab = (void *)((uintptr_t)ptr & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+        return slab->size;
+    }
+    /*
+     * Read without a lock: neighbours may rewrite prev_allocated in the
+     * same word, but block_size can't change while ptr is live.
+     */
+    block_t *block = ptr - sizeof(header_t);
+    return block->block_size - OVERHEAD;
+}
+
+#if MM_THREADS
+/*
+ * The following routines implement the per thread caches
+ */
+
+/*
+ * tcache_flush_bin - Give n payloads of bin back to their arenas. Each run
+ *     of payloads owned by one arena costs a single lock round trip, or a
+ *     single push onto its remote stack if it isn't the thread's arena.
+ */
+static void tcache_flush_bin(int bin, int n) {
+    while (n > 0 && tcache.head[bin] != NULL) {
+        void *p = tcache.head[bin];
+        arena_t *a = payload_arena(p, 0);
+        /* find the run of payloads a owns at the head of the bin */
+        void *last = p;
+        int run = 1;
+        while (run < n && *(void **)last != NULL && payload_arena(*(void **)last, 0) == a) {
+            last = *(void **)last;
+            run++;
+        }
+        tcache.head[bin] = *(void **)last;
+        tcache.count[bin] -= run;
+        n -= run;
+
+        if ((int)a->id != threadArena) {
+            remote_push(a, p, last);
+            continue;
+        }
+        ARENA_LOCK(a);
+        while (run-- > 0) {
+            void *next = *(void **)p; /* heap_free reuses the first word */
+            heap_free(a, p);
+            p = next;
+        }
+        ARENA_UNLOCK(a);
+    }
+}
+
+/* tcache_exit - pthread_key destructor, empties an exiting thread's tcache */
+static void tcache_exit(void *unused) {
+    (void)unused;
+    if (tcache.epoch != heap_epoch)
+        return;
+    for (int bin = 0; bin < TCACHE_BINS; bin++)
+        tcache_flush_bin(bin, TCACHE_COUNT);
+}
+
+static void tcache_make_key(void) {
+    pthread_key_create(&tcache_key, tcache_exit);
+}
+
+/*
+ * tcache_enter - Make the calling thread's tcache usable: drop entries
+ *                left over from a previous heap and register for flushing
+ */
+static inline void tcache_enter(void) {
+    if (tcache.epoch == heap_epoch)
+        return;
+    memset(tcache.head, 0, sizeof(tcache.head));
+    memset(tcache.count, 0, sizeof(tcache.count));
+    tcache.epoch = heap_epoch;
+    if (!tcache.registered) {
+        pthread_once(&tcache_once, tcache_make_key);
+        pthread_setspecific(tcache_key, &tcache);
+        tcache.registered = true;
+    }
+}
+
+/*
+ * tcache_get - Serve size bytes from the calling thread's tcache, refilling
+ *              an empty bin with a batch from an arena. NULL if not cached.
+ */
+static void *tcache_get(size_t size) {
+    if (size == 0 || size > TCACHE_MAX_SIZE)
+        return NULL;
+    int bin = (size + 7) >> 3;
+    tcache_enter();
+
+    if (tcache.head[bin] == NULL) {
+        /* refill: one lock round trip buys a whole batch of payloads */
+        arena_t *a = arena_acquire();
+        for (int i = 0; i < TCACHE_BATCH; i++) {
+            void *p = heap_malloc(a, bin << 3);
+            if (p == NULL)
+                break;
+            *(void **)p = tcache.head[bin];
+            tcache.head[bin] = p;
+            tcache.count[bin]++;
+        }
+        ARENA_UNLOCK(a);
+        if (tcache.head[bin] == NULL)
+            return NULL;
+    }
+    void *p = tcache.head[bin];
+    tcache.head[bin] = *(void **)p;
+    tcache.count[bin]--;
+    return p;
+}
+
+/*
+ * tcache_put - Keep a freed payload in the calling thread's tcache. False
+ *              if it is too big to be cached and must go to its arena.
+ *              A size of 8 or more, known not to exceed the usable size,
+ *              picks the bin without reading the header.
+ */
+static bool tcache_put(void *ptr, size_t size) {
+    size_t usable = size >= 8 ? size : usable_size(ptr);
+    if (usable > TCACHE_MAX_SIZE)
+        return false;
+    int bin = usable >> 3;
+    tcache_enter();
+
+    if (tcache.count[bin] >= TCACHE_COUNT)
+        tcache_flush_bin(bin, TCACHE_BATCH);
+    *(void **)ptr = tcache.head[bin];
+    tcache.head[bin] = ptr;
+    tcache.count[bin]++;
+    return true;
+}
+
+/*
+ * The following routines implement the remote free stacks
+ */
+
+/*
+ * remote_push - Hand the chain first..last of payloads owned by a (linked
+ *               through their first word) to a's remote stack, lock free.
+ *               Any number of threads may push at once.
+ */
+static void remote_push(arena_t *a, void *first, void *last) {
+    void *head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    do {
+        *(void **)last = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, first, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * remote_drain - Free every payload on a's remote stack, a's lock held.
+ *     The lock makes us the only consumer and the stack is taken as a whole,
+ *     so pops can't suffer from ABA. Returns whether there were any.
+ */
+static bool remote_drain(arena_t *a) {
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) == NULL)
+        return false;
+    void *p = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    while (p != NULL) {
+        void *next = *(void **)p;
+        heap_free(a, p);
+        p = next;
+    }
+    return true;
+}
+#endif
+
 static footer_t* get_footer(block_t *block) {
     return (void*)block + block->block_size - sizeof(footer_t);
 }
 
+/* set_footer - Copy the header of a free block into its footer */
+static void set_footer(block_t *block) {
+    footer_t *footer = get_footer(block);
+    footer->allocated = block->allocated;
+    footer->prev_allocated = block->prev_allocated;
+    footer->block_size = block->block_size;
+}
+
+static block_t *next_block(block_t *block) {
+    return (void *)block + block->block_size;
+}
+
 static void printblock(block_t *block) {
-    uint32_t hsize, halloc, fsize, falloc;
+    uint32_t hsize, halloc, hprev, fsize, falloc;
 
     hsize = block->block_size;
     halloc = block->allocated;
-    footer_t *footer = get_footer(block);
-    fsize = footer->block_size;
-    falloc = footer->allocated;
+    hprev = block->prev_allocated;
 
     if (hsize == 0) {
         printf("%p: EOL\n", block);
         return;
     }
 
-    printf("%p: header: [%d:%c] footer: [%d:%c]\n", block, hsize,
-           (halloc ? 'a' : 'f'), fsize, (falloc ? 'a' : 'f'));
-}
-
-static void checkblock(block_t *block) {
-    if ((uint64_t)block->body.payload % 8) {
-        printf("Error: payload for block at %p is not aligned\n", block);
+    if (halloc) {
+        printf("%p: header: [%d:%c:%c]\n", block, hsize,
+               (hprev ? 'a' : 'f'), 'a');
+        return;
     }
+
     footer_t *footer = get_footer(block);
-    if (block->block_size != footer->block_size) {
-        printf("Error: header does not match footer\n");
-    }
+    fsize = footer->block_size;
+    falloc = footer->allocated;
+    printf("%p: header: [%d:%c:%c] footer: [%d:%c]\n", block, hsize,
+           (hprev ? 'a' : 'f'), 'f', fsize, (falloc ? 'a' : 'f'));
 }
+
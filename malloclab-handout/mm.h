@@ -3,7 +3,23 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_usable_size(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern void *mm_calloc(size_t n, size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
+extern void mm_stats(void);
+extern unsigned mm_checkheap(int verbose);
+extern unsigned mm_checkheap_step(size_t blocks);
+extern int mm_set_fit_policy(int policy);
+extern const int mm_thread_safe; /* nonzero when built with MM_THREADS */
+
+/* Placement policies for mm_set_fit_policy and -DFIT_POLICY */
+#define FIT_FIRST 0 /* first block that fits */
+#define FIT_BEST 1  /* tightest block of the request's size class */
+#define FIT_GOOD 2  /* tightest of the first FIT_K blocks that fit */
 
 
 /*
@@ -0,0 +1,610 @@
+/*
+ * mmcapture.c - Record the allocations of a real process as a trace
+ *
+ * Preload mmcapture.so into any program and its malloc, free, realloc
+ * and calloc calls are written out as a trace mdriver can replay:
+ *
+ *     MMCAPTURE_OUT=app.rep LD_PRELOAD=./mmcapture.so app ...
+ *
+ * The output is a .rep trace, or a binary trace (trace.h) if the name
+ * ends in ".bin". A "%p" in the name stands for the pid, and without
+ * one only the first process is traced, not the ones it runs. The name
+ * defaults to mmcapture.%p.rep.
+ *
+ * The wrappers do no I/O and take no locks. Each thread appends the
+ * requests it makes to its own ring, stamped with a sequence number
+ * from one global counter, and a background thread drains the rings,
+ * puts the requests back in order and writes them out. It also maps the
+ * addresses to trace ids, handing freed ids out again so num_ids is the
+ * peak number of live blocks. Blocks still live at exit are freed at the
+ * end of the trace, so it is balanced.
+ *
+ * Only blocks the four calls return are traced. Frees of anything else,
+ * e.g. memory from before the shim started or from posix_memalign, are
+ * dropped and counted in the summary printed at exit.
+ */
+#define _GNU_SOURCE
+#include "trace.h"
+#include <dlfcn.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_SIZE (1 << 14)   /* requests buffered per thread */
+#define FLUSH_NSECS 1000000   /* how often the flusher wakes up */
+#define BOOTSTRAP_SIZE 4096   /* for dlsym's allocations before we have libc's */
+#define HEADER_WIDTH 20       /* of each .rep header field, to rewrite it at exit */
+#define TLS __attribute__((tls_model("initial-exec"))) __thread
+
+/* What a thread records, in the order it happens */
+enum { EV_ALLOC,         /* ptr was returned for size bytes */
+       EV_CALLOC,        /* the same, zeroed */
+       EV_FREE,          /* ptr is about to be freed */
+       EV_MOVE,          /* ptr is about to be realloc'd */
+       EV_REALLOC,       /* the EV_MOVE numbered ref ended at ptr, size bytes */
+       EV_REALLOC_FREE,  /* the EV_MOVE numbered ref freed the block */
+       EV_REALLOC_FAIL }; /* the EV_MOVE numbered ref failed, ptr is still live */
+
+typedef struct {
+    uint64_t seq;  /* position in the global order */
+    uint64_t ref;  /* seq of the EV_MOVE a realloc ends */
+    uintptr_t ptr;
+    uint64_t size;
+    uint32_t type;
+} rec_t;
+
+/* One thread's ring; the thread moves head, the flusher moves tail */
+typedef struct capbuf {
+    rec_t ring[RING_SIZE];
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t inflight; /* a lower bound on the seq being recorded, or UINT64_MAX */
+    uint64_t tail __attribute__((aligned(64)));
+    int owner;         /* 1 while a live thread records into it */
+    struct capbuf *next;
+} capbuf_t;
+
+/* Open addressing map of 64 bit keys to ids, no tombstones */
+typedef struct {
+    uint64_t *keys; /* 0 is empty */
+    uint32_t *vals;
+    size_t mask, count;
+} map_t;
+
+static void *(*real_malloc)(size_t);
+static void (*real_free)(void *);
+static void *(*real_realloc)(void *, size_t);
+static void *(*real_calloc)(size_t, size_t);
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+static int resolving;
+
+static int capturing;      /* the wrappers record requests */
+static int stopping;       /* the flusher should exit */
+static uint64_t next_seq;  /* the global order */
+static capbuf_t *buffers;  /* every ring ever made, owned or not */
+static pthread_key_t exit_key;
+static pthread_t flusher;
+static TLS capbuf_t *mybuf;
+static TLS int guard;      /* set inside the shim, whose allocations aren't traced */
+
+/* Owned by the flusher, and by the exit handler once the flusher is gone */
+static FILE *out;
+static char *out_path;
+static int binary;
+static rec_t *pending;     /* drained but not yet written */
+static size_t npending, pending_cap;
+static map_t live;         /* address -> id */
+static map_t moving;       /* seq of an unfinished realloc -> id */
+static uint32_t *free_ids, nfree, free_cap, num_ids;
+static uint64_t num_ops, dropped, oversized;
+
+/*
+ * resolve - Look up libc's functions. dlsym may itself allocate, which
+ *           the wrappers serve from the bootstrap buffer meanwhile
+ */
+static void resolve(void) {
+    resolving = 1;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    resolving = 0;
+    if (!real_malloc || !real_free || !real_realloc || !real_calloc) {
+        fprintf(stderr, "mmcapture: could not find libc's malloc\n");
+        abort();
+    }
+}
+
+static void *bootstrap_alloc(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (bootstrap_used + size > BOOTSTRAP_SIZE)
+        return NULL;
+    bootstrap_used += size;
+    return bootstrap + bootstrap_used - size;
+}
+
+static int is_bootstrap(void *ptr) {
+    return (char *)ptr >= bootstrap && (char *)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+/*
+ * thread_exit - Hand a finished thread's ring to the next new thread.
+ *               What the thread frees after this is not traced
+ */
+static void thread_exit(void *arg) {
+    capbuf_t *b = arg;
+    guard = 1;
+    __atomic_store_n(&b->owner, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * get_buf - The calling thread's ring, reusing one of an exited thread
+ *           or mapping a new one
+ */
+static capbuf_t *get_buf(void) {
+    capbuf_t *b;
+    int zero = 0;
+
+    guard++;
+    for (b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next)
+        if (__atomic_compare_exchange_n(&b->owner, &zero, 1, 0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            break;
+        else
+            zero = 0;
+    if (b == NULL) {
+        b = mmap(NULL, sizeof(capbuf_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (b == MAP_FAILED) {
+            guard--;
+            return NULL;
+        }
+        b->inflight = UINT64_MAX;
+        b->owner = 1;
+        b->next = __atomic_load_n(&buffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&buffers, &b->next, b, 1, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(exit_key, b);
+    guard--;
+    return mybuf = b;
+}
+
+/*
+ * record - Append a request to the thread's ring and return its seq,
+ *          or UINT64_MAX if it could not be recorded
+ *
+ * inflight is set below the seq before the seq is taken and cleared
+ * once the request is visible, so the flusher knows which seqs are
+ * still to come from this thread
+ */
+static uint64_t record(uint32_t type, void *ptr, uint64_t ref, uint64_t size) {
+    capbuf_t *b = mybuf;
+    uint64_t seq;
+
+    if (b == NULL && (b = get_buf()) == NULL)
+        return UINT64_MAX;
+    while (b->head - __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+        if (__atomic_load_n(&capturing, __ATOMIC_RELAXED))
+            sched_yield();
+        else
+            return UINT64_MAX;
+
+    __atomic_store_n(&b->inflight, __atomic_load_n(&next_seq, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    seq = __atomic_fetch_add(&next_seq, 1, __ATOMIC_SEQ_CST);
+    rec_t *r = &b->ring[b->head % RING_SIZE];
+    r->seq = seq;
+    r->ref = ref;
+    r->ptr = (uintptr_t)ptr;
+    r->size = size;
+    r->type = type;
+    __atomic_store_n(&b->head, b->head + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&b->inflight, UINT64_MAX, __ATOMIC_RELEASE);
+    return seq;
+}
+
+static int tracing(void) {
+    return __atomic_load_n(&capturing, __ATOMIC_RELAXED) && !guard;
+}
+
+/*
+ * The wrappers
+ */
+
+void *malloc(size_t size) {
+    if (real_malloc == NULL) {
+        if (resolving)
+            return bootstrap_alloc(size);
+        resolve();
+    }
+    void *p = real_malloc(size);
+    if (p != NULL && tracing())
+        record(EV_ALLOC, p, 0, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (real_calloc == NULL) {
+        if (resolving)
+            return bootstrap_alloc(nmemb * size); /* zero, being static */
+        resolve();
+    }
+    void *p = real_calloc(nmemb, size);
+    if (p != NULL && tracing())
+        record(EV_CALLOC, p, 0, nmemb * size);
+    return p;
+}
+
+void free(void *ptr) {
+    if (ptr == NULL || is_bootstrap(ptr))
+        return;
+    if (real_free == NULL)
+        resolve();
+    if (tracing())
+        record(EV_FREE, ptr, 0, 0);
+    real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size) {
+    uint64_t seq;
+    void *p;
+
+    if (ptr == NULL)
+        return malloc(size);
+    if (is_bootstrap(ptr)) {
+        size_t avail = bootstrap + BOOTSTRAP_SIZE - (char *)ptr;
+        if ((p = malloc(size)) != NULL)
+            memcpy(p, ptr, size < avail ? size : avail);
+        return p;
+    }
+    if (real_realloc == NULL)
+        resolve();
+    if (!tracing() || (seq = record(EV_MOVE, ptr, 0, 0)) == UINT64_MAX)
+        return real_realloc(ptr, size);
+
+    p = real_realloc(ptr, size);
+    if (p != NULL)
+        record(EV_REALLOC, p, seq, size);
+    else if (size == 0)
+        record(EV_REALLOC_FREE, NULL, seq, 0);
+    else
+        record(EV_REALLOC_FAIL, ptr, seq, 0);
+    return p;
+}
+
+/*
+ * The maps of the flusher
+ */
+
+static uint64_t hash(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    return key ^ (key >> 33);
+}
+
+static void map_put(map_t *m, uint64_t key, uint32_t val);
+
+static void map_grow(map_t *m) {
+    map_t old = *m;
+    size_t size = old.keys ? 2 * (old.mask + 1) : 1024;
+
+    m->keys = real_calloc(size, sizeof(uint64_t));
+    m->vals = real_malloc(size * sizeof(uint32_t));
+    if (m->keys == NULL || m->vals == NULL) {
+        fprintf(stderr, "mmcapture: out of memory\n");
+        abort();
+    }
+    m->mask = size - 1;
+    m->count = 0;
+    for (size_t i = 0; old.keys && i <= old.mask; i++)
+        if (old.keys[i])
+            map_put(m, old.keys[i], old.vals[i]);
+    real_free(old.keys);
+    real_free(old.vals);
+}
+
+/*
+ * map_put - Map key to val, the key being new
+ */
+static void map_put(map_t *m, uint64_t key, uint32_t val) {
+    size_t i;
+
+    if (2 * (m->count + 1) > m->mask + 1)
+        map_grow(m);
+    for (i = hash(key) & m->mask; m->keys[i]; i = (i + 1) & m->mask)
+        ;
+    m->keys[i] = key;
+    m->vals[i] = val;
+    m->count++;
+}
+
+/*
+ * map_take - Remove key and store its val, returning 0 if it is not there
+ */
+static int map_take(map_t *m, uint64_t key, uint32_t *val) {
+    size_t i, j, home;
+
+    if (m->keys == NULL)
+        return 0;
+    for (i = hash(key) & m->mask; m->keys[i] != key; i = (i + 1) & m->mask)
+        if (m->keys[i] == 0)
+            return 0;
+    *val = m->vals[i];
+    m->count--;
+
+    /* Shift the rest of the run back over the hole */
+    for (j = (i + 1) & m->mask; m->keys[j]; j = (j + 1) & m->mask) {
+        home = hash(m->keys[j]) & m->mask;
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+            m->keys[i] = m->keys[j];
+            m->vals[i] = m->vals[j];
+            i = j;
+        }
+    }
+    m->keys[i] = 0;
+    return 1;
+}
+
+static uint32_t id_get(void) {
+    return nfree ? free_ids[--nfree] : num_ids++;
+}
+
+static void id_put(uint32_t id) {
+    if (nfree == free_cap) {
+        free_cap = free_cap ? 2 * free_cap : 1024;
+        if ((free_ids = real_realloc(free_ids, free_cap * sizeof(uint32_t))) == NULL) {
+            fprintf(stderr, "mmcapture: out of memory\n");
+            abort();
+        }
+    }
+    free_ids[nfree++] = id;
+}
+
+/*
+ * The output
+ */
+
+static void emit(int type, uint32_t id, uint64_t size) {
+    if (type != FREE && size == 0)
+        size = 1; /* libc hands out a real block, mm_malloc(0) fails the replay */
+    if (binary) {
+        traceop_t op = {.type = type, .index = id, .size = size};
+        fwrite(&op, sizeof(op), 1, out);
+    } else if (type == FREE)
+        fprintf(out, "f %u\n", id);
+    else
+        fprintf(out, "%c %u %lu\n", type == ALLOC ? 'a' : type == CALLOC ? 'c' : 'r', id,
+                (unsigned long)size);
+    num_ops++;
+}
+
+static void emit_free(uint32_t id) {
+    emit(FREE, id, 0);
+    id_put(id);
+}
+
+/*
+ * emit_alloc - Give ptr a fresh id for an ALLOC or CALLOC, first freeing
+ *              the id of a block we thought still lived there (its free
+ *              was not traced)
+ */
+static void emit_alloc(int type, uintptr_t ptr, uint64_t size) {
+    uint32_t id;
+
+    if (map_take(&live, ptr, &id))
+        emit_free(id);
+    if (size > UINT32_MAX || num_ids > TRACE_MAX_INDEX) {
+        oversized++;
+        return;
+    }
+    id = id_get();
+    map_put(&live, ptr, id);
+    emit(type, id, size);
+}
+
+/*
+ * apply - Write out one request, in order
+ */
+static void apply(rec_t *r) {
+    uint32_t id, stale;
+
+    switch (r->type) {
+    case EV_ALLOC:
+        emit_alloc(ALLOC, r->ptr, r->size);
+        break;
+    case EV_CALLOC:
+        emit_alloc(CALLOC, r->ptr, r->size);
+        break;
+    case EV_FREE:
+        if (map_take(&live, r->ptr, &id))
+            emit_free(id);
+        else
+            dropped++;
+        break;
+    case EV_MOVE:
+        if (map_take(&live, r->ptr, &id))
+            map_put(&moving, r->seq + 1, id);
+        break;
+    case EV_REALLOC:
+        if (!map_take(&moving, r->ref + 1, &id)) {
+            emit_alloc(ALLOC, r->ptr, r->size); /* realloc of an untraced block */
+            break;
+        }
+        if (map_take(&live, r->ptr, &stale))
+            emit_free(stale);
+        if (r->size > UINT32_MAX) {
+            oversized++;
+            emit_free(id);
+            break;
+        }
+        map_put(&live, r->ptr, id);
+        emit(REALLOC, id, r->size);
+        break;
+    case EV_REALLOC_FREE:
+        if (map_take(&moving, r->ref + 1, &id))
+            emit_free(id);
+        break;
+    case EV_REALLOC_FAIL:
+        if (map_take(&moving, r->ref + 1, &id))
+            map_put(&live, r->ptr, id);
+        break;
+    }
+}
+
+static int cmp_seq(const void *a, const void *b) {
+    uint64_t x = ((const rec_t *)a)->seq, y = ((const rec_t *)b)->seq;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * drain - Move every visible request out of the rings and write out
+ *         those that no request still being recorded can precede
+ *
+ * next_seq is read before the list of rings, so a ring made later only
+ * holds seqs past the mark.
+ */
+static void drain(void) {
+    uint64_t mark = __atomic_load_n(&next_seq, __ATOMIC_SEQ_CST);
+    capbuf_t *b, *first = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE);
+    size_t n;
+
+    for (b = first; b != NULL; b = b->next) {
+        uint64_t inflight = __atomic_load_n(&b->inflight, __ATOMIC_SEQ_CST);
+        if (inflight < mark)
+            mark = inflight;
+    }
+    for (b = first; b != NULL; b = b->next) {
+        uint64_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+        if (npending + (head - b->tail) > pending_cap) {
+            pending_cap = 2 * (npending + (head - b->tail));
+            if ((pending = real_realloc(pending, pending_cap * sizeof(rec_t))) == NULL) {
+                fprintf(stderr, "mmcapture: out of memory\n");
+                abort();
+            }
+        }
+        for (; b->tail != head; b->tail++)
+            pending[npending++] = b->ring[b->tail % RING_SIZE];
+        __atomic_store_n(&b->tail, head, __ATOMIC_RELEASE);
+    }
+
+    qsort(pending, npending, sizeof(rec_t), cmp_seq);
+    for (n = 0; n < npending && pending[n].seq < mark; n++)
+        apply(&pending[n]);
+    memmove(pending, pending + n, (npending - n) * sizeof(rec_t));
+    npending -= n;
+}
+
+static void *flush_thread(void *arg) {
+    struct timespec nap = {0, FLUSH_NSECS};
+
+    guard = 1;
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        drain();
+        nanosleep(&nap, NULL);
+    }
+    return NULL;
+}
+
+static void write_header(void) {
+    if (binary) {
+        bintrace_hdr_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, BINTRACE_MAGIC, sizeof(hdr.magic));
+        hdr.num_ids = num_ids;
+        hdr.num_ops = num_ops;
+        hdr.weight = 1;
+        fwrite(&hdr, sizeof(hdr), 1, out);
+    } else
+        fprintf(out, "%-*d\n%-*u\n%-*lu\n%-*d\n", HEADER_WIDTH, 0, HEADER_WIDTH, num_ids,
+                HEADER_WIDTH, (unsigned long)num_ops, HEADER_WIDTH, 1);
+}
+
+/*
+ * child - The rings are the parent's, so a forked child is not traced
+ */
+static void child(void) {
+    capturing = 0;
+}
+
+__attribute__((constructor)) static void capture_start(void) {
+    static char path[PATH_MAX];
+    char pid[16];
+    char *name = getenv("MMCAPTURE_OUT"), *pct, *parent = getenv("MMCAPTURE_PID");
+    size_t len;
+
+    if (real_malloc == NULL)
+        resolve();
+    if (name == NULL)
+        name = "mmcapture.%p.rep";
+    if ((pct = strstr(name, "%p")) != NULL)
+        snprintf(path, sizeof(path), "%.*s%d%s", (int)(pct - name), name, (int)getpid(), pct + 2);
+    else if (parent != NULL && atoi(parent) != getpid())
+        return; /* a child of a traced process, which would overwrite its trace */
+    else
+        snprintf(path, sizeof(path), "%s", name);
+    guard++;
+    snprintf(pid, sizeof(pid), "%d", (int)getpid());
+    setenv("MMCAPTURE_PID", pid, 0);
+    out_path = path;
+    len = strlen(path);
+    binary = len >= 4 && !strcmp(path + len - 4, ".bin");
+    if ((out = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "mmcapture: could not create %s\n", path);
+        guard--;
+        return;
+    }
+    setvbuf(out, NULL, _IOFBF, 1 << 20);
+    write_header(); /* rewritten at exit */
+    pthread_key_create(&exit_key, thread_exit);
+    pthread_atfork(NULL, NULL, child);
+    if (pthread_create(&flusher, NULL, flush_thread, NULL) != 0) {
+        fprintf(stderr, "mmcapture: could not start the flusher\n");
+        fclose(out);
+        guard--;
+        return;
+    }
+    __atomic_store_n(&capturing, 1, __ATOMIC_RELEASE);
+    guard--;
+}
+
+__attribute__((destructor)) static void capture_stop(void) {
+    capbuf_t *b;
+
+    if (!__atomic_load_n(&capturing, __ATOMIC_ACQUIRE))
+        return;
+    guard++;
+    __atomic_store_n(&capturing, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(flusher, NULL);
+
+    /* Let requests already being recorded finish, then write out the rest */
+    for (b = __atomic_load_n(&buffers, __ATOMIC_ACQUIRE); b != NULL; b = b->next)
+        while (__atomic_load_n(&b->inflight, __ATOMIC_ACQUIRE) != UINT64_MAX)
+            sched_yield();
+    drain();
+    for (size_t i = 0; live.keys && i <= live.mask; i++)
+        if (live.keys[i])
+            emit(FREE, live.vals[i], 0);
+
+    if (fseek(out, 0, SEEK_SET) == 0)
+        write_header();
+    if (fclose(out) != 0)
+        fprintf(stderr, "mmcapture: could not write %s\n", out_path);
+    fprintf(stderr, "mmcapture: %lu requests, %u ids to %s", (unsigned long)num_ops, num_ids,
+            out_path);
+    if (dropped || oversized)
+        fprintf(stderr, " (%lu untraced frees, %lu blocks too large)", (unsigned long)dropped,
+                (unsigned long)oversized);
+    fprintf(stderr, "\n");
+    guard--;
+}
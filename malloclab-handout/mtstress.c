@@ -0,0 +1,226 @@
+/*
+ * mtstress.c - Producer/consumer stress of the thread safe allocator
+ *
+ * Each of several producer threads allocates blocks and passes them
+ * through a ring to its own consumer thread, which checks and frees them.
+ * Every free is thus a remote one, the case the arenas' remote stacks
+ * are built for. Reports the number of blocks moved per second. With -b
+ * blocks are allocated and freed with mm_malloc_batch and mm_free_batch.
+ * The heap is checked with mm_checkheap once all blocks are freed.
+ *
+ * mm.c has to be built with MM_THREADS=1, which "make mtstress" does.
+ */
+#include "memlib.h"
+#include "mm.h"
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define RING_SIZE 1024 /* blocks in flight per producer/consumer pair */
+#define MAX_PAIRS 64
+#define MAX_BATCH 256  /* most blocks -b can ask for */
+
+/* What a producer and its consumer share */
+typedef struct {
+    void *slot[RING_SIZE];
+    uint64_t head;        /* next slot the producer fills */
+    uint64_t tail;        /* next slot the consumer empties */
+    long count;           /* blocks to move */
+    unsigned seed;
+} ring_t;
+
+static ring_t rings[MAX_PAIRS];
+static int use_libc = 0;
+static int max_size = 256; /* block sizes are 1..max_size bytes */
+static int batch = 0;      /* if set, blocks go this many at a time (-b) */
+
+static void *alloc(size_t size) { return use_libc ? malloc(size) : mm_malloc(size); }
+static void release(void *p) { use_libc ? free(p) : mm_free(p); }
+
+/*
+ * alloc_batch - Allocate n blocks of size bytes into out[], returning how many
+ */
+static size_t alloc_batch(size_t size, size_t n, void **out) {
+    size_t got = 0;
+
+    if (!use_libc)
+        return mm_malloc_batch(size, n, out);
+    while (got < n && (out[got] = malloc(size)) != NULL)
+        got++;
+    return got;
+}
+
+/*
+ * release_batch - Free the n blocks of ptrs[]
+ */
+static void release_batch(void **ptrs, size_t n) {
+    if (!use_libc) {
+        mm_free_batch(ptrs, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++)
+        free(ptrs[i]);
+}
+
+/*
+ * producer - Allocate count blocks, stamp them with their size and
+ *            their sequence number and hand them to the consumer
+ */
+static void *producer(void *arg) {
+    ring_t *r = arg;
+    unsigned seed = r->seed;
+    void *out[MAX_BATCH];
+    size_t n = 0, next = 0; /* blocks in out[] and the next one to hand over */
+    size_t batch_size = 0;  /* what they all hold */
+
+    for (long i = 0; i < r->count; i++) {
+        size_t size = rand_r(&seed) % max_size + 1;
+        unsigned char *p;
+        if (batch) {
+            if (next == n) { /* the same size for a whole batch */
+                size_t want = (r->count - i < batch) ? r->count - i : batch;
+                batch_size = size;
+                n = alloc_batch(size < 8 ? 8 : size, want, out);
+                next = 0;
+                if (n < want) {
+                    fprintf(stderr, "mtstress: out of memory\n");
+                    exit(1);
+                }
+            }
+            size = batch_size;
+            p = out[next++];
+        } else if ((p = alloc(size < 8 ? 8 : size)) == NULL) {
+            fprintf(stderr, "mtstress: out of memory\n");
+            exit(1);
+        }
+        memcpy(p, &size, sizeof(uint32_t));
+        memset(p + sizeof(uint32_t), (unsigned char)i, (size < 8 ? 8 : size) - sizeof(uint32_t));
+        while (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SIZE)
+            sched_yield();
+        r->slot[r->head % RING_SIZE] = p;
+        __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * consumer - Check and free the blocks of one producer
+ */
+static void *consumer(void *arg) {
+    ring_t *r = arg;
+    void *done[MAX_BATCH];
+    size_t n = 0; /* checked blocks in done[] that wait to be freed */
+
+    for (long i = 0; i < r->count; i++) {
+        while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail)
+            sched_yield();
+        unsigned char *p = r->slot[r->tail % RING_SIZE];
+        __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+
+        uint32_t size;
+        memcpy(&size, p, sizeof(uint32_t));
+        size_t end = (size < 8 ? 8 : size) - 1;
+        if (p[sizeof(uint32_t)] != (unsigned char)i || p[end] != (unsigned char)i) {
+            fprintf(stderr, "mtstress: block %ld of %p was corrupted\n", i, (void *)r);
+            exit(1);
+        }
+        if (!batch) {
+            release(p);
+            continue;
+        }
+        done[n++] = p;
+        if (n == (size_t)batch) {
+            release_batch(done, n);
+            n = 0;
+        }
+    }
+    release_batch(done, n);
+    return NULL;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: mtstress [-hl] [-b <n>] [-p <pairs>] [-n <blocks>] [-s <size>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b <n>     Allocate and free n blocks at a time (at most %d).\n", MAX_BATCH);
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-l         Use libc malloc instead of mm.c.\n");
+    fprintf(stderr, "\t-n <n>     Blocks moved by each pair (default 1000000).\n");
+    fprintf(stderr, "\t-p <n>     Producer/consumer pairs (default 4).\n");
+    fprintf(stderr, "\t-s <n>     Largest block size (default 256).\n");
+}
+
+int main(int argc, char **argv) {
+    int pairs = 4;
+    long count = 1000000;
+    char c;
+    struct timeval start, stop;
+    pthread_t threads[2 * MAX_PAIRS];
+
+    while ((c = getopt(argc, argv, "b:hln:p:s:")) != EOF) {
+        switch (c) {
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 'l':
+            use_libc = 1;
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 'p':
+            pairs = atoi(optarg);
+            break;
+        case 's':
+            max_size = atoi(optarg);
+            break;
+        case 'h':
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (pairs < 1 || pairs > MAX_PAIRS || count < 1 || max_size < 1 ||
+        batch < 0 || batch > MAX_BATCH) {
+        usage();
+        exit(1);
+    }
+
+    if (!use_libc) {
+        mem_init();
+        if (mm_init() < 0) {
+            fprintf(stderr, "mtstress: mm_init failed\n");
+            exit(1);
+        }
+    }
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < pairs; i++) {
+        rings[i].count = count;
+        rings[i].seed = i + 1;
+        pthread_create(&threads[2 * i], NULL, producer, &rings[i]);
+        pthread_create(&threads[2 * i + 1], NULL, consumer, &rings[i]);
+    }
+    for (int i = 0; i < 2 * pairs; i++)
+        pthread_join(threads[i], NULL);
+    gettimeofday(&stop, NULL);
+
+    double secs = (stop.tv_sec - start.tv_sec) + (stop.tv_usec - start.tv_usec) / 1e6;
+    printf("%s: %d pairs moved %ld blocks in %.3f secs, %.0f Kblocks/sec",
+           use_libc ? "libc" : "mm", pairs, pairs * count, secs, pairs * count / secs / 1000);
+    if (!use_libc)
+        printf(", heap %zu KB", mem_heapsize() / 1024);
+    printf("\n");
+    if (!use_libc && mm_checkheap(0) != 0) {
+        fprintf(stderr, "mtstress: mm_checkheap found errors\n");
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,109 @@
+/*
+ * rep2bin.c - Convert a .rep trace into the binary format of trace.h
+ *
+ * The requests are read a line at a time and written out as packed
+ * traceop_t records, so traces of any length convert in constant memory.
+ * A trace whose ids or request count don't match its header is
+ * rejected, as mdriver rejects such a .rep.
+ */
+#include "trace.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXLINE 1024
+#define BATCH 4096 /* records written per fwrite */
+
+static void die(char *msg, char *path) {
+    fprintf(stderr, "rep2bin: %s %s\n", msg, path);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    FILE *in, *out;
+    bintrace_hdr_t hdr;
+    traceop_t ops[BATCH];
+    char line[MAXLINE], *p;
+    int sugg_heapsize, num_ids, num_ops, weight, n = 0;
+    unsigned long index, size;
+    uint32_t max_index = 0;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: rep2bin <in.rep> <out.bin>\n");
+        exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL)
+        die("could not open", argv[1]);
+    if ((out = fopen(argv[2], "w")) == NULL)
+        die("could not create", argv[2]);
+    if (fscanf(in, "%d %d %d %d", &sugg_heapsize, &num_ids, &num_ops, &weight) != 4 ||
+        num_ids < 0 || num_ops < 0)
+        die("bad header in", argv[1]);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BINTRACE_MAGIC, sizeof(hdr.magic));
+    hdr.sugg_heapsize = sugg_heapsize;
+    hdr.num_ids = num_ids;
+    hdr.weight = weight;
+    /* num_ops is filled in once all requests are written */
+    fwrite(&hdr, sizeof(hdr), 1, out);
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        for (p = line; isspace((unsigned char)*p); p++)
+            ;
+        if (*p == '\0')
+            continue;
+        switch (*p) {
+        case 'a':
+            ops[n].type = ALLOC;
+            break;
+        case 'r':
+            ops[n].type = REALLOC;
+            break;
+        case 'c':
+            ops[n].type = CALLOC;
+            break;
+        case 'm':
+            ops[n].type = MEMALIGN;
+            break;
+        case 'f':
+            ops[n].type = FREE;
+            break;
+        default:
+            die("bogus request in", argv[1]);
+        }
+        index = strtoul(p + 1, &p, 10);
+        if (ops[n].type == MEMALIGN) {
+            unsigned long align = strtoul(p, &p, 10);
+            size = strtoul(p, &p, 10);
+            if (index > TRACE_MAX_INDEX || !op_set_memalign(&ops[n], align, size))
+                die("id, alignment or size too large for the binary format in", argv[1]);
+        } else {
+            size = (ops[n].type == FREE) ? 0 : strtoul(p, &p, 10);
+            if (index > TRACE_MAX_INDEX || size > UINT32_MAX)
+                die("id or size too large for the binary format in", argv[1]);
+            ops[n].size = size;
+        }
+        if (index >= (unsigned long)num_ids)
+            die("id out of the header's range in", argv[1]);
+        ops[n].index = index;
+        if (index > max_index)
+            max_index = index;
+        if (++n == BATCH) {
+            fwrite(ops, sizeof(traceop_t), n, out);
+            hdr.num_ops += n;
+            n = 0;
+        }
+    }
+    fwrite(ops, sizeof(traceop_t), n, out);
+    hdr.num_ops += n;
+
+    if (hdr.num_ops != (uint64_t)num_ops || (num_ops > 0 && max_index + 1 != (uint32_t)num_ids))
+        die("header doesn't match the requests of", argv[1]);
+    if (fseek(out, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+        fclose(out) != 0)
+        die("could not write", argv[2]);
+    fclose(in);
+    return 0;
+}
@@ -0,0 +1,66 @@
+/*
+ * trace.h - Binary trace format shared by mdriver and rep2bin
+ *
+ * A binary trace is a bintrace_hdr_t followed by num_ops traceop_t
+ * records in host byte order. mdriver maps the file and replays the
+ * records where they are, so traceop_t is exactly what is on disk.
+ */
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stdint.h>
+
+#define BINTRACE_MAGIC "MMTRACE2" /* first 8 bytes of every binary trace */
+#define TRACE_MAX_INDEX ((1u << 29) - 1) /* largest id traceop_t holds */
+
+/* Request types, "a id size", "f id", "r id size", "c id size" and
+   "m id align size" in a .rep */
+enum { ALLOC,
+       FREE,
+       REALLOC,
+       CALLOC,    /* mm_calloc(1, size), which must come back zeroed */
+       MEMALIGN }; /* mm_memalign(align, size) */
+
+#define TRACE_ALIGN_SHIFT 27 /* a MEMALIGN's size keeps log2 of its alignment from this bit up */
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    uint32_t type : 3;   /* type of request */
+    uint32_t index : 29; /* index for free() to use later */
+    uint32_t size;       /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* op_size - Bytes op asks for */
+static inline uint32_t op_size(traceop_t op) {
+    return (op.type == MEMALIGN) ? op.size & ((1u << TRACE_ALIGN_SHIFT) - 1) : op.size;
+}
+
+/* op_align - Alignment a MEMALIGN op asks for */
+static inline uint64_t op_align(traceop_t op) {
+    return (uint64_t)1 << (op.size >> TRACE_ALIGN_SHIFT);
+}
+
+/*
+ * op_set_memalign - Make op a MEMALIGN of size bytes aligned to align,
+ *     0 if align isn't a power of two or size too large to pack with it
+ */
+static inline int op_set_memalign(traceop_t *op, uint64_t align, uint64_t size) {
+    if (align == 0 || (align & (align - 1)) != 0 || align > (1u << 31) ||
+        size >= (1u << TRACE_ALIGN_SHIFT))
+        return 0;
+    op->type = MEMALIGN;
+    op->size = (uint32_t)__builtin_ctzll(align) << TRACE_ALIGN_SHIFT | (uint32_t)size;
+    return 1;
+}
+
+/* Starts a binary trace, the same fields as a .rep header */
+typedef struct {
+    char magic[8];          /* BINTRACE_MAGIC, not NUL terminated */
+    uint32_t sugg_heapsize; /* suggested heap size (unused) */
+    uint32_t num_ids;       /* number of alloc/realloc ids */
+    uint64_t num_ops;       /* number of traceop_t records that follow */
+    uint32_t weight;        /* weight for this trace */
+    uint32_t reserved;      /* zero */
+} bintrace_hdr_t;
+
+#endif /* __TRACE_H_ */